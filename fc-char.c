@@ -13,28 +13,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <poll.h>
-#include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <dirent.h>
+#endif
 
 #include <fontconfig/fontconfig.h>
 #include <errno.h>
 #include <stdint.h>
 #include <iconv.h>
+#include <langinfo.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
-#include <X11/Xft/Xft.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
 #include <uninameslist.h>
+// fc-char-lite only prints, and is built without X.
+#ifndef FC_CHAR_LITE
+#include <X11/Xft/Xft.h>
+#include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xmu/Atoms.h>
 #include <X11/extensions/Xdbe.h>
+#endif
 
 #define DBG(...) { if(args.debug) fprintf(stderr, __VA_ARGS__); }
 
+#ifndef FC_CHAR_LITE
 #define DBG_P(...) { if(args.debug) { XFlush(global.dpy); fprintf(stderr, __VA_ARGS__); } }
+#endif
+
+// How results that differ only in style are collapsed.
+#define GROUP_NONE 0
+#define GROUP_FAMILY 1
+#define GROUP_FILE 2
+
+// How --sort ranks the fonts found.
+#define SORT_NONE 0
+#define SORT_COVERAGE 1
+#define SORT_MATCH 2
+#define SORT_NAME 3
 
-// Refresh rate for window
-#define TIMEOUT 100
+// Output formats for printed fonts.
+#define FORMAT_TEXT 0
+#define FORMAT_JSONL 1
+#define FORMAT_NUL 2
+#define FORMAT_TSV 3
 
 // Global storage of command line flags.
 struct {
@@ -45,12 +88,100 @@ struct {
   int showannot;
   int printfonts;
   int fixed;
-} args = { 1, 0, 0, 0, 0, 0, 0 };
+  char *cpfile;
+  int noindex;
+  int reindex;
+  int text;
+  char *textfile;
+  int server;
+  int client;
+  char *socket;
+  int jobs;
+  char *export;
+  int exportwidth;
+  int exportheight;
+  int group;
+  int format;
+  int stats;
+  char *trace;
+  int coverage;
+  int gaps;
+  char **blocks;
+  int nblocks;
+  char *fallback;
+  char *search;
+  int watch;
+  int sort;
+  int matrix;
+  int metrics;
+} args = { 1, 0, 0, 0, 0, 0, 0, NULL, 0, 0, 0, NULL, 0, 0, NULL, 1, NULL, 800, 600, GROUP_FAMILY,
+           FORMAT_TEXT, 0, NULL, 0, 0, NULL, 0, NULL, NULL, 0, SORT_NONE, 0, 0 };
+
+// Geometry of the character grid, see compute_layout().
+struct grid_layout {
+  unsigned int width;   // Size of grid area
+  unsigned int height;
+  int count;            // Fonts on all pages
+  int nw, nh;           // Columns and rows per page
+  int bw, bh;           // Box size
+  int fh, ch;           // Height of font name and character portions
+  int frh, crh, cw;     // Font name and character rendering area
+  int fw;               // Width of font name rendering area
+  int ncols;            // Characters per box, more than one in a matrix
+  int lw, colw;         // Font name and character column widths in a matrix
+  int perpage;
+  int npages;
+};
+
+// Inclusive range of requested code points.
+struct cprange {
+  uint32_t first;
+  uint32_t last;
+};
+
+// Description of a font found to contain a character.
+struct fontinfo {
+  const char *family;
+  const char *style;
+  const char *file;
+  int index;  // Face index within file
+  int id;     // Position in candidate font list or reverse index
+};
+
+struct index_header;
+struct names_header;
+struct coverage;
+
+// Events kept for --trace; older ones are overwritten.
+#define TRACECAP 65536
+
+// One completed span for --trace.
+struct trace_event {
+  const char *name;  // Static string
+  char arg[64];      // Font or other detail, may be empty
+  double ts;         // Start, ms on the stats clock
+  double dur;        // Length in ms
+  int tid;
+};
+
+// Growable buffer of NUL terminated strings.
+struct strbuf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
 
 struct {
+  // Fonts found for the displayed character
+  FcFontSet *fs;
+  // All candidate fonts, listed once with their charsets.
+  FcFontSet *allfs;
+  FcCharSet **charsets;
+  int fcinit;       // If fontconfig has been initialized
+#ifndef FC_CHAR_LITE
   // X11 Elements
   Display *dpy;
-  FcFontSet *fs;
   Drawable win;
   XftDraw *xdraw;
   XftColor ftblack;
@@ -58,18 +189,171 @@ struct {
   XColor black;
   GC xgc;
   Drawable backbuf; // Backing buffer if DBE enabled
-  Drawable draw;    // Drawable to draw to (window or back buffer)
-  double lastpaint; // Last time window was painted.
-  int dirty;        // If window needs to be repainted.
+  Pixmap pixmap;    // Backing buffer if DBE isn't available
+  Drawable draw;    // Drawable to draw to (back buffer or pixmap)
+  unsigned int winwidth;  // Window size from the last ConfigureNotify
+  unsigned int winheight;
+  double resizedue;       // Clock when a resize has settled, 0 if none
+  unsigned int bufwidth;  // Size of the last render into the buffer
+  unsigned int bufheight;
+  int bufvalid;     // If the buffer holds a complete render
+  int dirty;        // If window contents must be rendered again.
   int quitdims[4];
+  Atom wmdelete;    // Sent by the window manager to close the window
+  int prevdims[4];  // Page buttons, zero sized on a single page
+  int nextdims[4];
+  struct grid_layout layout;
+  int layoutvalid;  // If layout fits the current window and font count
+  int page;         // Page of the grid being shown
+  int gridoffset;   // Y offset of the grid below the title bar
+  unsigned char *celldone; // If each entry of fs has been drawn on this page
+  int cellsleft;    // Boxes on the page whose character isn't drawn yet
+  // Finished box images for entries of fs, most recently drawn
+  // first in a list linked through tilenext/tileprev.
+  Pixmap *tiles;
+  int *tilenext;
+  int *tileprev;
+  int tilehead;
+  int tiletail;
+  int ntiles;
+  int maxtiles;           // Tiles fitting in TILEBUDGET at the current size
+  unsigned int tilewidth; // Size of every cached tile
+  unsigned int tileheight;
+  // Family names of fs and their widths at INITFTSZ.
+  const char **families;
+  uint16_t *famwidths;
+  int maxfamwidth;
+  int famheight;
+  // Font for family names, scaled by titlescale.
+  XftFont *titlefont;
+  double titlescale;
+  // Glyphs of text queued for one XftDrawGlyphFontSpec() request.
+  XftGlyphFontSpec *textspecs;
+  int ntextspecs;
+  int textcap;
+#endif
   // Character information from libuninameslist
   struct unicode_nameannot info;
   // Desired character in UTF32
   uint32_t character;
   // Desired character as hex string
   char hexchar[11];
+  // All requested code points (batch mode if more than one).
+  struct cprange *ranges;
+  int nranges;
+  int rangecap;
+  uint32_t ncodepoints;
+  // Characters compared side by side with --matrix.
+  FcChar32 *matrix;
+  int nmatrix;
+  // Mapped name index for --search, while searching.
+  const struct names_header *names;
+  size_t namessize;
+  // What --sort ranks by, filled in when first needed.
+  int rankready;
+  struct coverage *rankcov;
+  uint32_t *ranktotal;
+  int *rankmatch;
+  // Fonts in fallback order for --fallback, with their charsets.
+  FcFontSet *fallback;
+  FcCharSet **fallbackcs;
+  // Mapped reverse index, if in use.
+  const struct index_header *index;
+  size_t indexsize;
+  // Fonts found by collect_fonts().
+  struct fontinfo *results;
+  int resultcap;
+  // Scratch space for group_results().
+  int *groupslots;
+  int groupsize;
+  int *groupnext;
+  int *grouptail;
+  int groupcap;
+  struct strbuf styles;  // Joined styles of grouped results
+  // Locale decoding, see decode_locale_string().
+  int utf8locale;        // Negative until checked
+  iconv_t iconv;         // Opened on first use in other locales
+  // --stats bookkeeping
+  double statstart;      // Clock at startup
+  int gridpasses;        // generate_grid() calls so far
+  int painted;           // If the first complete paint was reported
+  // --trace ring buffer, allocated once at startup.
+  struct trace_event *trace;
+  unsigned long tracenext;  // Events recorded so far
 } global;
 
+// Thread number recorded in trace events.
+static __thread int trace_tid;
+
+/** Reads the monotonic clock.
+ *
+ * \return Milliseconds from an arbitrary starting point.
+ */
+double stats_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/** Starts a traced span.
+ *
+ * \return Start time to pass to trace_end().
+ */
+double trace_begin()
+{
+  return global.trace ? stats_clock() : 0.0;
+}
+
+/** Records a span started by trace_begin() in the ring buffer.
+ *
+ * Safe to call from any thread. Nothing is written out until
+ * write_trace().
+ *
+ * \param name Static span name.
+ * \param arg Detail such as a family name, or NULL.
+ */
+void trace_end(const char *name, const char *arg, double start)
+{
+  if(global.trace == NULL) {
+    return;
+  }
+
+  double end = stats_clock();
+  unsigned long n = __atomic_fetch_add(&global.tracenext, 1, __ATOMIC_RELAXED);
+  struct trace_event *e = &global.trace[n % TRACECAP];
+  e->name = name;
+  if(arg != NULL) {
+    strncpy(e->arg, arg, sizeof(e->arg) - 1);
+    e->arg[sizeof(e->arg) - 1] = '\0';
+  } else {
+    e->arg[0] = '\0';
+  }
+  e->ts = start;
+  e->dur = end - start;
+  e->tid = trace_tid + 1;
+}
+
+/** Reports the time taken by a phase with --stats.
+ *
+ * \param start Clock at the start of the phase.
+ */
+void stats_phase(const char *phase, double start)
+{
+  if(args.stats) {
+    fprintf(stderr, "stats: %-20s %10.3f ms\n", phase, stats_clock() - start);
+  }
+}
+
+/** Reports a count with --stats.
+ */
+void stats_count(const char *what, unsigned long count)
+{
+  if(args.stats) {
+    fprintf(stderr, "stats: %-20s %10lu\n", what, count);
+  }
+}
+
 
 /** Parses arguments and returns location of first non-option argument.
  *
@@ -90,16 +374,38 @@ int parse_arguments(int argc, char *argv[])
           {"annotation" , no_argument      , 0, 'a'},
           {"print"      , no_argument      , 0, 'p'},
           {"fixed"      , no_argument      , 0, 'f'},
+          {"file"       , required_argument, 0, 'F'},
+          {"noindex"    , no_argument      , 0, 'I'},
+          {"reindex"    , no_argument      , 0, 'R'},
+          {"text"       , optional_argument, 0, 't'},
+          {"server"     , optional_argument, 0, 'S'},
+          {"client"     , optional_argument, 0, 'C'},
+          {"jobs"       , required_argument, 0, 'j'},
+          {"export"     , required_argument, 0, 'e'},
+          {"geometry"   , required_argument, 0, 'g'},
+          {"group"      , required_argument, 0, 'G'},
+          {"format"     , required_argument, 0, 'o'},
+          {"stats"      , no_argument,       0, 's'},
+          {"trace"      , required_argument, 0, 'T'},
+          {"coverage"   , no_argument,       0, 'V'},
+          {"gaps"       , no_argument,       0, 'u'},
+          {"block"      , required_argument, 0, 'b'},
+          {"fallback"   , required_argument, 0, 'L'},
+          {"search"     , required_argument, 0, 'q'},
+          {"watch"      , no_argument,       0, 'W'},
+          {"sort"       , required_argument, 0, 'r'},
+          {"matrix"     , no_argument,       0, 'x'},
+          {"metrics"    , no_argument,       0, 'M'},
           {0            , 0                , 0, 0}
         };
 
-        int c = getopt_long(argc, argv, "Nnhm:dapc::", long_options, &option_index);
+        int c = getopt_long(argc, argv, "Nnhm:dapc::F:IRt::S::C::j:e:g:G:o:sT:Vub:L:q:Wr:xM", long_options, &option_index);
 
         switch(c)
         {
         case 'h':
           printf("fc-char v" VERSION "\n");
-          printf("Usage: %s [options] {<hex codepoint>|<character>}\n", argv[0]);
+          printf("Usage: %s [options] {<hex codepoint>|<character>|<range>}...\n", argv[0]);
           printf("Options:\n");
           printf("--help         / -h        :  Show help (this)\n");
           printf("--nodisplay    / -N        :  Don't display found glyphs.\n");
@@ -109,7 +415,32 @@ int parse_arguments(int argc, char *argv[])
           printf("--annotation   / -a        :  Print unicode character annotation string.\n");
           printf("--print        / -p        :  Print list of fonts with character.\n");
           printf("--fixed        / -f        :  Include fixed-size fonts.\n");
-          return -1;
+          printf("--file FILE    / -F FILE   :  Read code points from FILE (- for stdin).\n");
+          printf("--noindex      / -I        :  Don't use the cached font index.\n");
+          printf("--reindex      / -R        :  Rebuild the cached font index.\n");
+          printf("--text[=FILE]  / -t[FILE]  :  Check UTF-8 text from FILE or stdin for coverage.\n");
+          printf("--server[=SOCK]/ -S[SOCK]  :  Answer queries on a Unix socket.\n");
+          printf("--client[=SOCK]/ -C[SOCK]  :  Send queries to a running server.\n");
+          printf("--jobs #       / -j#       :  Threads to scan fonts with (0 for one per CPU).\n");
+          printf("--export FILE  / -e FILE   :  Write the grid to a PNG or PPM file without X.\n");
+          printf("--geometry WxH / -g WxH    :  Size of exported images (default 800x600).\n");
+          printf("--group TYPE   / -G TYPE   :  Collapse fonts by family (default), file or none.\n");
+          printf("--format FMT   / -o FMT    :  Print fonts as text, jsonl, tsv or nul records.\n");
+          printf("--stats        / -s        :  Print timings and counts to stderr.\n");
+          printf("--trace FILE   / -T FILE   :  Write a Chrome trace of drawing to FILE.\n");
+          printf("--coverage     / -V        :  Report code points per Unicode block for each font.\n");
+          printf("--gaps         / -u        :  List assigned code points that no font covers.\n");
+          printf("--block NAME   / -b NAME   :  Request every code point of a Unicode block.\n");
+          printf("--fallback FAM / -L FAM    :  Also print the font fontconfig falls back to for FAM.\n");
+          printf("--search TEXT  / -q TEXT   :  Request every character whose name or annotation has TEXT.\n");
+          printf("--watch        / -W        :  With --server, pick up fonts as they're installed.\n");
+          printf("--sort TYPE    / -r TYPE   :  Rank fonts by coverage, match or name before -m.\n");
+          printf("--matrix       / -x        :  Display several characters side by side for each font.\n");
+          printf("--metrics      / -M        :  Print glyph metrics from each font as JSON lines.\n");
+          printf("\nRanges are given as U+XXXX..U+YYYY. When more than one code point\n");
+          printf("is requested the fonts for each are printed instead of displayed,\n");
+          printf("unless --matrix is given.\n");
+          return -2;
           break;
 
         case 'N':
@@ -139,6 +470,153 @@ int parse_arguments(int argc, char *argv[])
           args.fixed = 1;
           break;
 
+        case 'F':
+          args.cpfile = optarg;
+          break;
+
+        case 'I':
+          args.noindex = 1;
+          break;
+
+        case 'R':
+          args.reindex = 1;
+          break;
+
+        case 't':
+          args.text = 1;
+          args.textfile = optarg;
+          break;
+
+        case 'S':
+          args.server = 1;
+          args.socket = optarg;
+          break;
+
+        case 'C':
+          args.client = 1;
+          args.socket = optarg;
+          break;
+
+        case 'j':
+          args.jobs = atoi(optarg);
+          break;
+
+        case 'e':
+          args.export = optarg;
+          args.display = 0;
+          break;
+
+        case 's':
+          args.stats = 1;
+          break;
+
+        case 'V':
+          args.coverage = 1;
+          break;
+
+        case 'u':
+          args.gaps = 1;
+          break;
+
+        case 'L':
+          args.fallback = optarg;
+          break;
+
+        case 'x':
+          args.matrix = 1;
+          break;
+
+        case 'M':
+          args.metrics = 1;
+          args.display = 0;
+          break;
+
+        case 'W':
+#ifdef HAVE_SYS_INOTIFY_H
+          args.watch = 1;
+#else
+          fprintf(stderr, "Watching font directories isn't supported on this system.\n");
+          return -2;
+#endif
+          break;
+
+        case 'q':
+          args.search = optarg;
+          args.showname = 1;
+          break;
+
+        case 'b':
+          // Looked up in main(), once the arguments are parsed.
+          if(args.blocks == NULL) {
+            args.blocks = (char **)malloc(argc * sizeof(char *));
+            if(args.blocks == NULL) {
+              fprintf(stderr, "Out of memory.\n");
+              return -2;
+            }
+          }
+          args.blocks[args.nblocks++] = optarg;
+          break;
+
+        case 'T':
+          args.trace = optarg;
+          global.trace = (struct trace_event *)malloc(TRACECAP * sizeof(struct trace_event));
+          if(global.trace == NULL) {
+            fprintf(stderr, "Out of memory for trace.\n");
+            return -2;
+          }
+          break;
+
+        case 'o':
+          if(strcmp(optarg, "text") == 0) {
+            args.format = FORMAT_TEXT;
+          } else if(strcmp(optarg, "jsonl") == 0) {
+            args.format = FORMAT_JSONL;
+          } else if(strcmp(optarg, "tsv") == 0) {
+            args.format = FORMAT_TSV;
+          } else if(strcmp(optarg, "nul") == 0) {
+            args.format = FORMAT_NUL;
+          } else {
+            fprintf(stderr, "Invalid format '%s'.\n", optarg);
+            return -2;
+          }
+          if(args.format != FORMAT_TEXT)
+            args.printfonts = 1;
+          break;
+
+        case 'G':
+          if(strcmp(optarg, "none") == 0) {
+            args.group = GROUP_NONE;
+          } else if(strcmp(optarg, "family") == 0) {
+            args.group = GROUP_FAMILY;
+          } else if(strcmp(optarg, "file") == 0) {
+            args.group = GROUP_FILE;
+          } else {
+            fprintf(stderr, "Invalid grouping '%s'.\n", optarg);
+            return -2;
+          }
+          break;
+
+        case 'r':
+          if(strcmp(optarg, "coverage") == 0) {
+            args.sort = SORT_COVERAGE;
+          } else if(strcmp(optarg, "match") == 0) {
+            args.sort = SORT_MATCH;
+          } else if(strcmp(optarg, "name") == 0) {
+            args.sort = SORT_NAME;
+          } else {
+            fprintf(stderr, "Invalid sort '%s'.\n", optarg);
+            return -2;
+          }
+          break;
+
+        case 'g':
+          if((sscanf(optarg, "%dx%d", &args.exportwidth, &args.exportheight) != 2) ||
+             (args.exportwidth <= 0) || (args.exportheight <= 0)) {
+            fprintf(stderr, "Invalid geometry '%s'.\n", optarg);
+            return -2;
+          }
+          break;
+
         default:
           if(optind < argc) {
             return optind;
@@ -154,261 +632,901 @@ int parse_arguments(int argc, char *argv[])
 // Initial font size to use in scaling.
 #define INITFTSZ 12.0
 
-/** Determines font size for the title string.
+#ifndef FC_CHAR_LITE
+
+/** Looks up the family names of the found fonts and
+ *  measures them once at INITFTSZ.
  *
- * This iterates through the list of fonts, determining
- * the maximum size that will render all family names
- * within the given width and height.
+ * The widths never change for a given font set, so later
+ * repaints only need to rescale from the cached values.
  *
- * \param family Font family to use in rendering.
- * \param width Width of render box.
- * \param height Height of render box.
- * \return Newly allocated font at appropriate size or NULL on error.
+ * \param family Font family used to render the names.
+ * \return Zero on success, negative on error.
  */
-XftFont *gen_scale_title_font(const char *family, int width, int height)
+int measure_families(const char *family)
 {
     XftFont *font = XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
                                 FC_FAMILY, XftTypeString, family,
                                 FC_SIZE, XftTypeDouble, INITFTSZ,
                                 NULL);
     if(font == NULL) {
-      return NULL;
+      return -1;
     }
 
-    double scale = -1.0;
+    int n = global.fs->nfont;
+    global.families = (const char **)calloc(n + 1, sizeof(*global.families));
+    global.famwidths = (uint16_t *)calloc(n + 1, sizeof(*global.famwidths));
+    if((global.families == NULL) || (global.famwidths == NULL)) {
+      XftFontClose(global.dpy, font);
+      return -1;
+    }
 
-    for(int i = 0; i < global.fs->nfont; i++) {
-      FcChar8 *famname = FcPatternFormat(global.fs->fonts[i], (FcChar8 *)"%{family[0]}");
-      if(famname == NULL) {
-        XftFontClose(global.dpy, font);
-        return NULL;
+    global.maxfamwidth = 0;
+    for(int i = 0; i < n; i++) {
+      FcChar8 *famname;
+      if(FcPatternGetString(global.fs->fonts[i], FC_FAMILY, 0, &famname) != FcResultMatch) {
+        famname = (FcChar8 *)"";
       }
+      global.families[i] = (const char *)famname;
 
       XGlyphInfo extents;
-      XftTextExtents8(global.dpy, font, famname, strlen((char *)famname), &extents);
-      free(famname);
-
-      double xscale = (double)width / (double)extents.width;
-      /*double yscale = (double)height / (double)extents.height;*/
-      double yscale = (double)height / (double)font->height;
-      double newscale = xscale < yscale ? xscale : yscale;
-
-      if((scale < 0) || (newscale < scale)) {
-        scale = newscale;
+      XftTextExtentsUtf8(global.dpy, font, famname, strlen((char *)famname), &extents);
+      global.famwidths[i] = extents.width;
+      if(extents.width > global.maxfamwidth) {
+        global.maxfamwidth = extents.width;
       }
     }
+    global.famheight = font->height;
 
     XftFontClose(global.dpy, font);
 
-    return XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
-                       FC_FAMILY, XftTypeString, family,
-                       FC_SIZE, XftTypeDouble, INITFTSZ * scale,
-                       NULL);
+    return 0;
 }
 
-/** Draws the grid of characters.
+/** Determines font size for the title string.
  *
- * \param width Width of grid area
- * \param height Height of grid area
- * \param yoffset Y offset from top of drawable to grid area.
- * \param character The character to render.
+ * This finds the maximum size that will render all
+ * family names within the given width and height
+ * using the widths cached by measure_families().
+ *
+ * \param family Font family to use in rendering.
+ * \param width Width of render box.
+ * \param height Height of render box.
+ * \return Font at appropriate size, owned by the cache, or NULL on error.
  */
-int generate_grid(unsigned int width, unsigned int height, int yoffset, FcChar32 *character)
+XftFont *gen_scale_title_font(const char *family, int width, int height)
 {
-// Vertical padding (pixels)
-#define VPADDING 5
-// Horizontal padding (pixels)
-#define HPADDING 5
-// How much vertical space for font name (percentage)
-#define FTSPACE 0.2
-// Font name font
-#define FTNAMEFT "charter"
-// Border width (pixels)
-#define BDRWIDTH 2
-
-    // Number of fonts to render
-    int c = (args.maxfonts && (args.maxfonts < global.fs->nfont)) ? args.maxfonts : global.fs->nfont;
-    // Number of columns
-    int nw = (int)round(sqrt((double)c * (double)width / (double)height));
-    // Number of rows
-    int nh = (int)round((double)c / (double)nw);
-    // Width of each box
-    int bw = (int)floor((double)width / (double)nw);
-    // Height of each box
-    int bh = (int)floor((double)height / (double)nh);
-    // Height of font name portion
-    int fh = (int)((double)bh * FTSPACE);
-    // Height of character portion
-    int ch = bh - fh;
-    // Height of font name rendering area
-    int frh = fh - 2*VPADDING;
-    // Height of character rendering area
-    int crh = ch - 2*VPADDING;
-    // Width of font name & character rendering area
-    int cw = bw - 2*HPADDING;
+    if((global.famwidths == NULL) && (measure_families(family) < 0)) {
+      return NULL;
+    }
 
-    DBG("nw %d nh %d\n", nw, nh);
-    DBG("bw %d bh %d\n", bw, bh);
+    double scale = (double)height / (double)global.famheight;
+    if(global.maxfamwidth > 0) {
+      double xscale = (double)width / (double)global.maxfamwidth;
+      if(xscale < scale)
+        scale = xscale;
+    }
 
-    if((frh <= 0) || (crh <= 0) || (cw <= 0)) {
-      return -1;
+    if((global.titlefont != NULL) && (scale == global.titlescale)) {
+      return global.titlefont;
     }
 
-    // Determine font size to use when rendering font names
-    XftFont *fnfont = gen_scale_title_font(FTNAMEFT, cw, frh);
-    if(fnfont == NULL) {
-      return -1;
+    double start = trace_begin();
+    if(global.titlefont != NULL) {
+      XftFontClose(global.dpy, global.titlefont);
     }
+    global.titlescale = scale;
+    global.titlefont = XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
+                                   FC_FAMILY, XftTypeString, family,
+                                   FC_SIZE, XftTypeDouble, INITFTSZ * scale,
+                                   NULL);
+    trace_end("gen_scale_title_font", family, start);
 
-    // Render characters, names, and grid squares.
-    for(int i = 0; i < c; i++) {
-      // Render grid rectangle
-      int rx = (i % nw) * bw;
-      int ry = (i / nw) * bh + yoffset;
-      XDrawRectangle(global.dpy, global.draw, global.xgc, rx, ry, bw, bh);
-      DBG_P("Rectangle (%d, %d) %d x %d\n", rx, ry, bw, bh);
+    return global.titlefont;
+}
 
-      int xcoord = (i % nw) * bw + HPADDING;
-      int ycoord = (i / nw) * bh + frh + VPADDING + yoffset;
-      XGlyphInfo extents;
-      FcChar8 *family = FcPatternFormat(global.fs->fonts[i], (FcChar8 *)"%{family[0]}");
-      XftTextExtentsUtf8(global.dpy, fnfont, family, strlen((char *)family), &extents);
-      int xadjust = (cw - extents.width) / 2;
-      if(xadjust > 0)
-        xcoord += xadjust;
+// Bytes of server memory allowed for cached box images.
+#define TILEBUDGET (32 * 1024 * 1024)
 
-      XftDrawStringUtf8(global.xdraw, &global.ftblack, fnfont,
-                        xcoord, ycoord, family, strlen((char *)family));
+/** Frees every cached box image.
+ */
+void flush_tiles()
+{
+    if(global.tiles == NULL) {
+      return;
+    }
 
-      DBG_P("Family name: %s\n", family);
+    for(int i = global.tilehead; i >= 0; i = global.tilenext[i]) {
+      XFreePixmap(global.dpy, global.tiles[i]);
+      global.tiles[i] = None;
+    }
+    global.tilehead = global.tiletail = -1;
+    global.ntiles = 0;
+}
 
-      XftFont *cfont = XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
-                                   FC_FAMILY, XftTypeString, family,
-                                   FC_PIXEL_SIZE, XftTypeDouble, (double)crh,
-                                   NULL);
+/** Removes a tile from the recently used list.
+ */
+void unlink_tile(int i)
+{
+    int prev = global.tileprev[i], next = global.tilenext[i];
+    if(prev >= 0)
+      global.tilenext[prev] = next;
+    else
+      global.tilehead = next;
+    if(next >= 0)
+      global.tileprev[next] = prev;
+    else
+      global.tiletail = prev;
+}
 
-      free(family);
+/** Puts a tile at the front of the recently used list.
+ */
+void push_tile(int i)
+{
+    global.tileprev[i] = -1;
+    global.tilenext[i] = global.tilehead;
+    if(global.tilehead >= 0)
+      global.tileprev[global.tilehead] = i;
+    else
+      global.tiletail = i;
+    global.tilehead = i;
+}
 
-      XftTextExtents32(global.dpy, cfont, character, 1, &extents);
+/** Sets the tile size, dropping tiles of any other size.
+ *
+ * \return Zero if tiles can be cached, negative otherwise.
+ */
+int size_tiles(unsigned int width, unsigned int height)
+{
+    if(global.tiles == NULL) {
+      int n = global.fs->nfont + 1;
+      global.tiles = (Pixmap *)calloc(n, sizeof(Pixmap));
+      global.tilenext = (int *)calloc(n, sizeof(int));
+      global.tileprev = (int *)calloc(n, sizeof(int));
+      global.tilehead = global.tiletail = -1;
+      if((global.tiles == NULL) || (global.tilenext == NULL) || (global.tileprev == NULL)) {
+        free(global.tiles);
+        free(global.tilenext);
+        free(global.tileprev);
+        global.tiles = NULL;
+        return -1;
+      }
+    }
 
-      DBG("extents at new size w %d h %d x %d y %d xoff %d yoff %d\n",
-          extents.width, extents.height, extents.x, extents.y,
-          extents.xOff, extents.yOff);
-      DBG("font info: height %d ascent %d descent %d\n", cfont->height,
-          cfont->ascent, cfont->descent);
+    if((width != global.tilewidth) || (height != global.tileheight)) {
+      flush_tiles();
+      global.tilewidth = width;
+      global.tileheight = height;
+      size_t bytes = (size_t)width * height * 4;
+      global.maxtiles = bytes > 0 ? (int)(TILEBUDGET / bytes) : 0;
+      DBG("Tile size %u x %u, %d tiles\n", width, height, global.maxtiles);
+    }
 
-      xcoord = (i % nw) * bw + HPADDING;
-      ycoord = (i / nw) * bh + fh + crh + VPADDING + yoffset - cfont->descent;
-      xadjust = (cw - extents.width) / 2;
-      if(xadjust > 0)
-        xcoord += xadjust;
-      // Render character
-      DBG("Rendering character at (%d,%d)\n", xcoord, ycoord);
-      DBG_P("Character render\n");
+    return global.maxtiles > 0 ? 0 : -1;
+}
 
-      XftDrawString32(global.xdraw, &global.ftblack, cfont,
-                      xcoord, ycoord, character, 1);
-      XftFontClose(global.dpy, cfont);
+/** Returns the cached image of a grid box, if there is one
+ *  at the given size.
+ *
+ * \param i Index of the font in the found font set.
+ */
+Pixmap find_tile(int i, unsigned int width, unsigned int height)
+{
+    if((size_tiles(width, height) < 0) || (global.tiles[i] == None)) {
+      return None;
     }
 
-    XftFontClose(global.dpy, fnfont);
-
-    return 0;
+    unlink_tile(i);
+    push_tile(i);
+    return global.tiles[i];
 }
 
-/** Converts a character in the local code page to UTF32LE.
+/** Copies a finished grid box from the drawable into the cache,
+ *  evicting the least recently used tiles to stay in budget.
  *
- * \param input Buffer containing the character to convert.
- * \param output Destination buffer, should be at least 5 bytes long.
- * \param outsize The size of the destination buffer.
- * \param uchar Buffer to store character encoded as 32-bit unsigned
+ * \param i Index of the font in the found font set.
  */
-int convert_char(char *input, char *output, int outsize, uint32_t *uchar)
+void store_tile(int i, int x, int y, unsigned int width, unsigned int height)
 {
-  iconv_t it = iconv_open("UTF32LE", "");
-  if(it == (iconv_t)-1) {
-    fprintf(stderr, "Error initializing iconv: %s\n", strerror(errno));
-    return -1;
-  }
-
-  size_t inbytesleft = strlen(input);
-  size_t outbytesleft = 10;
-  char outbuf[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  char *obufaddr = &outbuf[0];
+    if((global.draw == global.win) || (size_tiles(width, height) < 0)) {
+      return;
+    }
 
-  size_t converted = iconv(it, &input, &inbytesleft, &obufaddr, &outbytesleft);
+    if(global.tiles[i] == None) {
+      while((global.ntiles >= global.maxtiles) && (global.tiletail >= 0)) {
+        int old = global.tiletail;
+        unlink_tile(old);
+        XFreePixmap(global.dpy, global.tiles[old]);
+        global.tiles[old] = None;
+        global.ntiles--;
+      }
+      global.tiles[i] = XCreatePixmap(global.dpy, global.win, width, height,
+                                      DefaultDepth(global.dpy, DefaultScreen(global.dpy)));
+      global.ntiles++;
+    } else {
+      unlink_tile(i);
+    }
+    push_tile(i);
 
-  if(converted < 0) {
-    fprintf(stderr, "Error converting glyph: %s\n", strerror(errno));
-    return -1;
-  }
+    XCopyArea(global.dpy, global.draw, global.tiles[i], global.xgc,
+              x, y, width, height, 0, 0);
+}
 
-  *uchar = *(uint32_t *)outbuf;
-  if(*uchar <= 0xFFFF) {
-    snprintf(output, outsize, "U+%04x", *(uint32_t *)outbuf);
-  } else {
-    snprintf(output, outsize, "U+%08x", *(uint32_t *)outbuf);
+/** Makes the rendered buffer visible.
+ *
+ * With a pixmap only the given area is copied; a DBE
+ * swap always shows the whole back buffer.
+ */
+void show_buffer(int x, int y, unsigned int width, unsigned int height)
+{
+  if(global.backbuf != None) {
+    XdbeSwapInfo sinfo;
+    sinfo.swap_window = global.win;
+    sinfo.swap_action = XdbeCopied;
+    XdbeSwapBuffers(global.dpy, &sinfo, 1);
+  } else if(global.pixmap != None) {
+    XCopyArea(global.dpy, global.pixmap, global.win, global.xgc,
+              x, y, width, height, x, y);
   }
 
-  iconv_close(it);
+  double start = trace_begin();
+  XFlush(global.dpy);
+  trace_end("XFlush", NULL, start);
+}
 
-  if(*(uint32_t *)outbuf == 0) {
-    printf("Glyph result was 0.\n");
-    return 0;
-  }
+#endif
 
-  return 1;
-}
+// Vertical padding (pixels)
+#define VPADDING 5
+// Horizontal padding (pixels)
+#define HPADDING 5
+// How much vertical space for font name (percentage)
+#define FTSPACE 0.2
+// Font name font
+#define FTNAMEFT "charter"
+// Border width (pixels)
+#define BDRWIDTH 2
+// Smallest box before the grid is split into pages (pixels)
+#define MINBOXW 96
+#define MINBOXH 96
+// Title bar font
+#define TITLEFONT "charter"
+#define TITLEFONTSZ 14.0
+// Most characters compared in a matrix
+#define MATRIXMAX 64
+// Width of a matrix's font name column (fraction of the window)
+#define MXNAMEW 0.25
+// How much of a matrix row's height the font name may use
+#define MXNAMESPACE 0.5
+// Smallest matrix row before it is split into pages (pixels)
+#define MINROWH 48
 
-/** Connects to X and creates the application's window.
+/** Works out the matrix geometry: one row per font with its
+ *  name on the left, then a column for each character.
  *
- * \return Zero on success, negative on failure.
+ * Rows are as tall as fit every font, up to square character
+ * cells; below MINROWH as many rows as fit make up one page.
+ *
+ * \return Zero on success, negative if the area is too small.
  */
-int initialize_x11()
+int compute_matrix(struct grid_layout *gl, unsigned int width, unsigned int height, int count)
 {
-  global.dpy = XOpenDisplay(NULL);
+    gl->nw = 1;
+    gl->bw = (int)width;
+    gl->lw = (int)((double)width * MXNAMEW);
+    gl->colw = (gl->bw - gl->lw) / gl->ncols;
 
-  memset(&global.white, 0, sizeof(global.white));
-  global.white.red = global.white.green = global.white.blue = 65535;
-  Status stat = XAllocColor(global.dpy, XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)),
-                            &global.white);
-  if(stat == 0) {
-    fprintf(stderr, "Could not allocate background color\n");
-    return -1;
-  }
+    gl->bh = (int)height / count;
+    if(gl->bh > gl->colw)
+      gl->bh = gl->colw;
+    if(gl->bh < MINROWH)
+      gl->bh = MINROWH;
+    gl->nh = (int)height / gl->bh;
+    if(gl->nh < 1)
+      gl->nh = 1;
+    if(gl->nh > count)
+      gl->nh = count;
 
-  memset(&global.black, 0, sizeof(global.black));
-  stat = XAllocColor(global.dpy, XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)),
-                     &global.black);
-  if(stat == 0) {
-    fprintf(stderr, "Could not allocate foreground color\n");
-    return -1;
-  }
+    gl->perpage = gl->nh;
+    gl->npages = (count + gl->perpage - 1) / gl->perpage;
+    // Names sit beside the characters rather than above them.
+    gl->fh = 0;
+    gl->ch = gl->bh;
+    gl->frh = (int)((double)gl->bh * MXNAMESPACE) - 2*VPADDING;
+    gl->crh = (gl->bh < gl->colw ? gl->bh : gl->colw) - 2*VPADDING;
+    gl->cw = gl->colw - 2*HPADDING;
+    gl->fw = gl->lw - 2*HPADDING;
 
-  XSetWindowAttributes winattr;
-  winattr.backing_store = Always;
-  winattr.event_mask = ExposureMask | ButtonPressMask | ButtonReleaseMask;
-  winattr.background_pixel = global.white.pixel;
-  global.win = XCreateWindow(global.dpy, RootWindow(global.dpy, XDefaultScreen(global.dpy)),
-                             0, 0, 800, 600, 1,
-                             CopyFromParent, InputOutput,
-                             CopyFromParent, CWBackPixel | CWEventMask | CWBackingStore,
-                             &winattr);
+    DBG("matrix rows %d pages %d\n", gl->nh, gl->npages);
+    DBG("bh %d lw %d colw %d\n", gl->bh, gl->lw, gl->colw);
 
-  global.draw = global.win;
+    if((gl->frh <= 0) || (gl->crh <= 0) || (gl->cw <= 0) || (gl->fw <= 0)) {
+      return -1;
+    }
 
-  // Allocate back buffer
-  int maj, min;
-  global.backbuf = None;
-//if(XdbeQueryExtension(global.dpy, &maj, &min)) {
-// FIXME: Get Visual info and check support for db on screens
-//    global.backbuf = XdbeAllocateBackBufferName(global.dpy, global.win, XdbeCopied);
-//    if(global.backbuf  == None) {
-//      DBG("Could not allocate back buffer.\n");
-//    } else {
-//      global.draw = global.backbuf;
-//    }
-//  }
+    return 0;
+}
+
+/** Works out the grid geometry for an area of the window.
+ *
+ * Boxes are made as large as possible while fitting every font;
+ * if they would be smaller than MINBOXW x MINBOXH, as many
+ * minimum-sized boxes as fit make up one page.
+ *
+ * \param width Width of grid area
+ * \param height Height of grid area
+ * \param count Number of fonts to render
+ * \param ncols Characters shown for each font; above one the
+ *        fonts are laid out as a matrix by compute_matrix().
+ * \return Zero on success, negative if the area is too small.
+ */
+int compute_layout(struct grid_layout *gl, unsigned int width, unsigned int height, int count,
+                   int ncols)
+{
+    memset(gl, 0, sizeof(*gl));
+    gl->width = width;
+    gl->height = height;
+    gl->count = count;
+    gl->ncols = ncols;
+
+    if((count <= 0) || (width == 0) || (height == 0) || (ncols <= 0)) {
+      return -1;
+    }
+
+    if(ncols > 1) {
+      return compute_matrix(gl, width, height, count);
+    }
+
+    // Number of columns
+    gl->nw = (int)round(sqrt((double)count * (double)width / (double)height));
+    if(gl->nw < 1)
+      gl->nw = 1;
+    if(gl->nw > count)
+      gl->nw = count;
+    // Number of rows
+    gl->nh = (count + gl->nw - 1) / gl->nw;
+    // Width of each box
+    gl->bw = (int)floor((double)width / (double)gl->nw);
+    // Height of each box
+    gl->bh = (int)floor((double)height / (double)gl->nh);
+
+    if((gl->bw < MINBOXW) || (gl->bh < MINBOXH)) {
+      gl->nw = (int)width / MINBOXW;
+      gl->nh = (int)height / MINBOXH;
+      if(gl->nw < 1)
+        gl->nw = 1;
+      if(gl->nh < 1)
+        gl->nh = 1;
+      gl->bw = (int)width / gl->nw;
+      gl->bh = (int)height / gl->nh;
+    }
+
+    gl->perpage = gl->nw * gl->nh;
+    gl->npages = (count + gl->perpage - 1) / gl->perpage;
+    // Height of font name portion
+    gl->fh = (int)((double)gl->bh * FTSPACE);
+    // Height of character portion
+    gl->ch = gl->bh - gl->fh;
+    // Height of font name rendering area
+    gl->frh = gl->fh - 2*VPADDING;
+    // Height of character rendering area
+    gl->crh = gl->ch - 2*VPADDING;
+    // Width of font name & character rendering area
+    gl->cw = gl->bw - 2*HPADDING;
+    gl->fw = gl->cw;
+    gl->colw = gl->bw;
+
+    DBG("nw %d nh %d pages %d\n", gl->nw, gl->nh, gl->npages);
+    DBG("bw %d bh %d\n", gl->bw, gl->bh);
+
+    if((gl->frh <= 0) || (gl->crh <= 0) || (gl->cw <= 0)) {
+      return -1;
+    }
+
+    return 0;
+}
+
+#ifndef FC_CHAR_LITE
+/** Queues a UTF-8 string, starting at a baseline point, to be
+ *  drawn by the next flush_text() in a single request with the
+ *  rest of the queued text.
+ *
+ * \return Zero on success, negative if out of memory.
+ */
+int queue_text(XftFont *font, const char *text, int x, int y)
+{
+    const FcChar8 *p = (const FcChar8 *)text;
+    int len = strlen(text);
+    while(len > 0) {
+      FcChar32 ucs4;
+      int n = FcUtf8ToUcs4(p, &ucs4, len);
+      if(n <= 0)
+        break;
+      p += n;
+      len -= n;
+
+      if(global.ntextspecs == global.textcap) {
+        int cap = global.textcap ? 2 * global.textcap : 256;
+        XftGlyphFontSpec *specs = (XftGlyphFontSpec *)realloc(global.textspecs, cap * sizeof(*specs));
+        if(specs == NULL) {
+          return -1;
+        }
+        global.textspecs = specs;
+        global.textcap = cap;
+      }
+
+      FT_UInt glyph = XftCharIndex(global.dpy, font, ucs4);
+      XGlyphInfo extents;
+      XftGlyphExtents(global.dpy, font, &glyph, 1, &extents);
+      XftGlyphFontSpec *spec = &global.textspecs[global.ntextspecs++];
+      spec->font = font;
+      spec->glyph = glyph;
+      spec->x = x;
+      spec->y = y;
+      x += extents.xOff;
+    }
+
+    return 0;
+}
+
+/** Draws all queued text.
+ */
+void flush_text()
+{
+    if(global.ntextspecs > 0) {
+      double start = trace_begin();
+      XftDrawGlyphFontSpec(global.xdraw, &global.ftblack, global.textspecs, global.ntextspecs);
+      DBG("Drew %d queued glyphs\n", global.ntextspecs);
+      global.ntextspecs = 0;
+      trace_end("text", NULL, start);
+    }
+}
+
+/** Queues the family name of one box of the grid.
+ *
+ * \param fnfont Font from gen_scale_title_font().
+ * \param i Index of the font in the found font set.
+ * \param rx, ry Top-left corner of the box.
+ */
+void queue_label(const struct grid_layout *gl, XftFont *fnfont, int i, int rx, int ry)
+{
+    int xcoord = rx + HPADDING;
+    int ycoord = ry + gl->frh + VPADDING;
+    XGlyphInfo extents;
+    const FcChar8 *family = (const FcChar8 *)global.families[i];
+    XftTextExtentsUtf8(global.dpy, fnfont, family, strlen((char *)family), &extents);
+    if(gl->ncols > 1) {
+      // Matrix names are left aligned and centered on the row.
+      ycoord = ry + (gl->bh + gl->frh) / 2;
+    } else {
+      int xadjust = (gl->fw - extents.width) / 2;
+      if(xadjust > 0)
+        xcoord += xadjust;
+    }
+
+    queue_text(fnfont, (const char *)family, xcoord, ycoord);
+}
+
+/** Separates the name and character columns of a matrix
+ *  down the given rows, in one request.
+ *
+ * \param y Top of the first row.
+ */
+void draw_separators(const struct grid_layout *gl, int y, int rows)
+{
+    if((gl->ncols <= 1) || (rows <= 0)) {
+      return;
+    }
+
+    XSegment lines[MATRIXMAX];
+    for(int c = 0; c < gl->ncols; c++) {
+      lines[c].x1 = lines[c].x2 = gl->lw + c * gl->colw;
+      lines[c].y1 = y;
+      lines[c].y2 = y + rows * gl->bh;
+    }
+    XDrawSegments(global.dpy, global.draw, global.xgc, lines, gl->ncols);
+}
+
+/** Draws the frame of one page of the grid: the boxes
+ *  and font names. Glyphs are rendered by the cell
+ *  workers and put on screen by draw_cells().
+ *
+ * \param gl Grid geometry from compute_layout().
+ * \param yoffset Y offset from top of drawable to grid area.
+ */
+int generate_grid(const struct grid_layout *gl, int yoffset)
+{
+    int nw = gl->nw, bw = gl->bw, bh = gl->bh;
+
+    global.gridoffset = yoffset;
+    if(global.celldone != NULL) {
+      memset(global.celldone, 0, global.fs->nfont);
+    } else {
+      global.celldone = (unsigned char *)calloc(global.fs->nfont + 1, 1);
+      if(global.celldone == NULL) {
+        return -1;
+      }
+    }
+
+    double start = trace_begin();
+
+    // Determine font size to use when rendering font names
+    XftFont *fnfont = gen_scale_title_font(FTNAMEFT, gl->fw, gl->frh);
+    if(fnfont == NULL) {
+      return -1;
+    }
+
+    int first = global.page * gl->perpage;
+    int last = first + gl->perpage;
+    if(last > gl->count)
+      last = gl->count;
+
+    XRectangle *rects = (XRectangle *)malloc((last - first + 1) * sizeof(XRectangle));
+    if(rects == NULL) {
+      return -1;
+    }
+
+    // Render names and grid squares. The squares and the names
+    // each go to the server in one request for the whole page.
+    for(int i = first; i < last; i++) {
+      double tilestart = trace_begin();
+      int cell = i - first;
+      int rx = (cell % nw) * bw;
+      int ry = (cell / nw) * bh + yoffset;
+      rects[cell].x = rx;
+      rects[cell].y = ry;
+      rects[cell].width = bw;
+      rects[cell].height = bh;
+
+      // A box drawn before at this size is copied whole.
+      Pixmap tile = find_tile(i, bw - 1, bh - 1);
+      if(tile != None) {
+        XCopyArea(global.dpy, tile, global.draw, global.xgc, 0, 0, bw - 1, bh - 1, rx + 1, ry + 1);
+        global.celldone[i] = 1;
+        trace_end("tile", global.families[i], tilestart);
+        continue;
+      }
+
+      queue_label(gl, fnfont, i, rx, ry);
+    }
+
+    if(last > first) {
+      XDrawRectangles(global.dpy, global.draw, global.xgc, rects, last - first);
+      DBG("Drew %d rectangles\n", last - first);
+    }
+    free(rects);
+    flush_text();
+
+    // Matrix columns go down every row at once. Rows still to be
+    // drawn store them in their tiles; tiled rows already had them.
+    draw_separators(gl, yoffset, last - first);
+
+    global.cellsleft = 0;
+    for(int i = first; i < last; i++) {
+      if(!global.celldone[i])
+        global.cellsleft++;
+    }
+    trace_end("generate_grid", NULL, start);
+
+    return 0;
+}
+
+// Boxes put on screen between checks for X events
+#define CELLBATCH 8
+
+// Time without a new size before a resized window is laid out (ms)
+#define SETTLEMS 75
+
+#endif
+
+/** Looks up the libuninameslist entry for a code point.
+ */
+struct unicode_nameannot lookup_info(uint32_t character)
+{
+  return UnicodeNameAnnot[(character>>16)&0x1f][(character>>8)&0xff][character&0xff];
+}
+
+/** Formats a code point as a U+ hex string.
+ */
+void format_codepoint(char *output, int outsize, uint32_t character)
+{
+  snprintf(output, outsize, "U+%04X", character);
+}
+
+// Incremental UTF-8 decoder state, carried between input chunks.
+struct utf8_decoder {
+  uint32_t cp;            // Partially decoded code point
+  uint32_t min;           // Smallest code point allowed for the sequence length
+  int need;               // Continuation bytes still expected
+  unsigned long invalid;  // Malformed sequences skipped
+};
+
+// Sequence length started by each byte, 0 if it can't lead one.
+static const unsigned char utf8_length[256] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,  4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Payload bits of a lead byte and the smallest code point
+// allowed, by sequence length.
+static const unsigned char utf8_leadmask[5] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+static const uint32_t utf8_min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+/** Copies the run of ASCII bytes at the start of a buffer.
+ *
+ * \return Number of bytes copied.
+ */
+size_t utf8_ascii_run(const unsigned char *in, size_t len, uint32_t *out)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while(i + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    if(_mm_movemask_epi8(v) != 0)
+      break;
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+    i += 16;
+  }
+#else
+  while(i + 8 <= len) {
+    uint64_t word;
+    memcpy(&word, in + i, sizeof(word));
+    if(word & 0x8080808080808080ULL)
+      break;
+    for(int k = 0; k < 8; k++) {
+      out[i + k] = in[i + k];
+    }
+    i += 8;
+  }
+#endif
+
+  while((i < len) && (in[i] < 0x80)) {
+    out[i] = in[i];
+    i++;
+  }
+
+  return i;
+}
+
+/** Decodes a chunk of UTF-8.
+ *
+ * Sequences split across chunks are completed by the next call.
+ * Malformed, overlong and surrogate sequences are skipped and counted.
+ * Runs of ASCII are copied a vector at a time.
+ *
+ * \param out Destination, must have room for len code points.
+ * \return Number of code points decoded.
+ */
+size_t utf8_decode(struct utf8_decoder *d, const unsigned char *in, size_t len, uint32_t *out)
+{
+  size_t n = 0;
+
+  for(size_t i = 0; i < len; i++) {
+    unsigned char b = in[i];
+
+    if(d->need > 0) {
+      if((b & 0xC0) == 0x80) {
+        d->cp = (d->cp << 6) | (b & 0x3F);
+        if(--d->need == 0) {
+          if((d->cp < d->min) || (d->cp > 0x10FFFF) ||
+             ((d->cp >= 0xD800) && (d->cp <= 0xDFFF))) {
+            d->invalid++;
+          } else {
+            out[n++] = d->cp;
+          }
+        }
+        continue;
+      }
+      // Truncated sequence, reprocess this byte as a new lead.
+      d->invalid++;
+      d->need = 0;
+    }
+
+    if(b < 0x80) {
+      size_t run = utf8_ascii_run(in + i, len - i, out + n);
+      n += run;
+      i += run - 1;
+      continue;
+    }
+
+    int seqlen = utf8_length[b];
+    if(seqlen == 0) {
+      d->invalid++;
+      continue;
+    }
+    d->cp = b & utf8_leadmask[seqlen];
+    d->min = utf8_min[seqlen];
+    d->need = seqlen - 1;
+  }
+
+  return n;
+}
+
+/** Checks if the current locale's character encoding is UTF-8.
+ */
+int locale_is_utf8()
+{
+  if(global.utf8locale < 0) {
+    const char *codeset = nl_langinfo(CODESET);
+    global.utf8locale = (strcasecmp(codeset, "UTF-8") == 0) || (strcasecmp(codeset, "utf8") == 0);
+  }
+  return global.utf8locale;
+}
+
+/** Decodes a string in the locale's character encoding.
+ *
+ * UTF-8 is decoded directly; iconv is opened once and only
+ * used for other encodings.
+ *
+ * \param out Destination, must have room for strlen(input) code points.
+ * \return Number of code points decoded, negative on invalid input.
+ */
+int decode_locale_string(const char *input, uint32_t *out)
+{
+  size_t len = strlen(input);
+
+  if(locale_is_utf8()) {
+    struct utf8_decoder dec;
+    memset(&dec, 0, sizeof(dec));
+    size_t n = utf8_decode(&dec, (const unsigned char *)input, len, out);
+    if(dec.invalid || dec.need) {
+      fprintf(stderr, "Invalid UTF-8 in '%s'.\n", input);
+      return -1;
+    }
+    return (int)n;
+  }
+
+  if(global.iconv == (iconv_t)-1) {
+    global.iconv = iconv_open("UTF-32LE", "");
+    if(global.iconv == (iconv_t)-1) {
+      fprintf(stderr, "Error initializing iconv: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  iconv(global.iconv, NULL, NULL, NULL, NULL);
+
+  // Every input byte yields at most one code point.
+  char *inbuf = (char *)input;
+  size_t inleft = len;
+  char *outbuf = (char *)out;
+  size_t outleft = len * sizeof(uint32_t);
+  if(iconv(global.iconv, &inbuf, &inleft, &outbuf, &outleft) == (size_t)-1) {
+    fprintf(stderr, "Error converting '%s': %s\n", input, strerror(errno));
+    return -1;
+  }
+
+  int n = (int)((len * sizeof(uint32_t) - outleft) / sizeof(uint32_t));
+  const unsigned char *le = (const unsigned char *)out;
+  for(int i = 0; i < n; i++, le += 4) {
+    out[i] = le[0] | (le[1] << 8) | (le[2] << 16) | ((uint32_t)le[3] << 24);
+  }
+  return n;
+}
+
+#ifndef FC_CHAR_LITE
+/** Describes what the window shows: the character and its
+ *  name, or the code points of a matrix.
+ *
+ * \return Title to be freed by the caller, or NULL if out of memory.
+ */
+char *window_title()
+{
+  if(global.nmatrix > 1) {
+    char *title = (char *)malloc(global.nmatrix * 11 + 1);
+    if(title == NULL) {
+      return NULL;
+    }
+    int len = 0;
+    for(int c = 0; c < global.nmatrix; c++) {
+      if(len > 0)
+        title[len++] = ' ';
+      format_codepoint(title + len, 11, global.matrix[c]);
+      len += strlen(title + len);
+    }
+    return title;
+  }
+
+  char *title;
+  if(global.info.name != NULL) {
+    int tsize = 16 + strlen(global.info.name);
+    title = (char *)malloc(tsize);
+    if(title != NULL)
+      snprintf(title, tsize, "%s %s", global.hexchar, global.info.name);
+  } else {
+    title = (char *)malloc(16);
+    if(title != NULL)
+      snprintf(title, 16, "%s", global.hexchar);
+  }
+  return title;
+}
+
+/** Connects to X and creates the application's window.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int initialize_x11()
+{
+  global.dpy = XOpenDisplay(NULL);
+
+  memset(&global.white, 0, sizeof(global.white));
+  global.white.red = global.white.green = global.white.blue = 65535;
+  Status stat = XAllocColor(global.dpy, XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)),
+                            &global.white);
+  if(stat == 0) {
+    fprintf(stderr, "Could not allocate background color\n");
+    return -1;
+  }
+
+  memset(&global.black, 0, sizeof(global.black));
+  stat = XAllocColor(global.dpy, XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)),
+                     &global.black);
+  if(stat == 0) {
+    fprintf(stderr, "Could not allocate foreground color\n");
+    return -1;
+  }
+
+  // The size is tracked from ConfigureNotify from here on.
+  global.winwidth = 800;
+  global.winheight = 600;
+
+  XSetWindowAttributes winattr;
+  winattr.backing_store = Always;
+  winattr.event_mask = ExposureMask | StructureNotifyMask | KeyPressMask |
+                       ButtonPressMask | ButtonReleaseMask;
+  winattr.background_pixel = global.white.pixel;
+  global.win = XCreateWindow(global.dpy, RootWindow(global.dpy, XDefaultScreen(global.dpy)),
+                             0, 0, global.winwidth, global.winheight, 1,
+                             CopyFromParent, InputOutput,
+                             CopyFromParent, CWBackPixel | CWEventMask | CWBackingStore,
+                             &winattr);
+
+  global.draw = global.win;
+
+  // Allocate back buffer, if the window's visual supports it.
+  int maj, min;
+  global.backbuf = None;
+  global.pixmap = None;
+  if(XdbeQueryExtension(global.dpy, &maj, &min)) {
+    Drawable root = RootWindow(global.dpy, XDefaultScreen(global.dpy));
+    VisualID visual = XVisualIDFromVisual(XDefaultVisual(global.dpy, XDefaultScreen(global.dpy)));
+    int nscreens = 1;
+    XdbeScreenVisualInfo *vinfo = XdbeGetVisualInfo(global.dpy, &root, &nscreens);
+    int supported = 0;
+    if(vinfo != NULL) {
+      for(int i = 0; i < vinfo->count; i++) {
+        if(vinfo->visinfo[i].visual == visual) {
+          supported = 1;
+        }
+      }
+      XdbeFreeVisualInfo(vinfo);
+    }
+
+    if(supported) {
+      global.backbuf = XdbeAllocateBackBufferName(global.dpy, global.win, XdbeCopied);
+    }
+    if(global.backbuf == None) {
+      DBG("Could not allocate back buffer, using pixmap.\n");
+    } else {
+      global.draw = global.backbuf;
+    }
+  }
+
+  // The buffer is copied over every exposed area, so the server
+  // doesn't need to clear it first.
+  XSetWindowBackgroundPixmap(global.dpy, global.win, None);
 
   // Setup drawing surfaces for fonts and grid.
   global.xdraw = XftDrawCreate(global.dpy, global.draw, XDefaultVisual(global.dpy, XDefaultScreen(global.dpy)),
@@ -421,298 +1539,5747 @@ int initialize_x11()
   XGCValues gcvalues;
   gcvalues.foreground = global.black.pixel;
   gcvalues.line_width = BDRWIDTH;
-  global.xgc = XCreateGC(global.dpy, global.draw, GCForeground | GCLineWidth, &gcvalues);
+  // Copying the buffer to the window shouldn't generate (No)Expose events.
+  gcvalues.graphics_exposures = False;
+  global.xgc = XCreateGC(global.dpy, global.draw,
+                         GCForeground | GCLineWidth | GCGraphicsExposures, &gcvalues);
 
   // Tell the WM about us
-  char *title;
-  if(global.info.name != NULL) {
-    int tsize = 16 + strlen(global.info.name);
-    title = (char *)malloc(tsize);
-    snprintf(title, tsize, "fc-char %s %s", global.hexchar, global.info.name);
-  } else {
-    title = (char *)malloc(16);
-    snprintf(title, 16, "fc-char %s", global.hexchar);
+  char *desc = window_title();
+  if(desc == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  int tsize = 16 + strlen(desc);
+  char *title = (char *)malloc(tsize);
+  if(title == NULL) {
+    free(desc);
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  snprintf(title, tsize, "fc-char %s", desc);
+  free(desc);
+  XTextProperty xtitle;
+  XStringListToTextProperty(&title, 1, &xtitle);
+  XSetWMName(global.dpy, global.win, &xtitle);
+  free(title);
+  // XFree(&xtext);
+
+  char smtitle[] = "fc-char";
+  char *psmtitle = &smtitle[0];
+  XTextProperty xsmtitle;
+  XStringListToTextProperty(&psmtitle, 1, &xsmtitle);
+  XSetWMIconName(global.dpy, global.win, &xsmtitle);
+  // XFree(&xsmtitle);
+
+  global.wmdelete = XInternAtom(global.dpy, "WM_DELETE_WINDOW", False);
+  stat = XSetWMProtocols(global.dpy, global.win, &global.wmdelete, 1);
+  DBG("WMProtocol Status %d\n", stat);
+
+
+  DBG("Exposing window\n");
+
+  // Expose the window
+  XMapWindow(global.dpy, global.win);
+
+  return 0;
+}
+
+/** Free X resources.
+ */
+void close_x11()
+{
+  flush_tiles();
+  free(global.tiles);
+  free(global.tilenext);
+  free(global.tileprev);
+  global.tiles = NULL;
+  if(global.titlefont != NULL) {
+    XftFontClose(global.dpy, global.titlefont);
+    global.titlefont = NULL;
+  }
+  free(global.families);
+  free(global.famwidths);
+  free(global.celldone);
+  free(global.textspecs);
+  global.textspecs = NULL;
+  global.families = NULL;
+  global.famwidths = NULL;
+  global.celldone = NULL;
+
+  XftColorFree(global.dpy, XDefaultVisual(global.dpy, XDefaultScreen(global.dpy)),
+               XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)), &global.ftblack);
+  XftDrawDestroy(global.xdraw);
+  XFreeGC(global.dpy, global.xgc);
+
+  if(global.backbuf != None) {
+    XdbeDeallocateBackBufferName(global.dpy, global.backbuf);
+  }
+  if(global.pixmap != None) {
+    XFreePixmap(global.dpy, global.pixmap);
+  }
+
+  XUnmapWindow(global.dpy, global.win);
+  XDestroyWindow(global.dpy, global.win);
+  XCloseDisplay(global.dpy);
+}
+
+/** Checks if the buffer holds a render at the window's current size,
+ *  so exposed areas can be copied from it instead of repainted.
+ */
+int buffer_current()
+{
+  if(!global.bufvalid || (global.draw == global.win)) {
+    return 0;
+  }
+
+  return (global.winwidth == global.bufwidth) && (global.winheight == global.bufheight);
+}
+
+/** Draws a labelled button in the title bar.
+ *
+ * \param x Left edge of the button.
+ * \param dims Set to the button's x, y, width and height.
+ * \return Width of the button.
+ */
+int draw_button(XftFont *font, const char *label, int x, int dims[4])
+{
+  XGlyphInfo extents;
+  XftTextExtents8(global.dpy, font, (FcChar8 *)label, strlen(label), &extents);
+  dims[0] = x;
+  dims[1] = VPADDING;
+  dims[2] = 2 * HPADDING + extents.width;
+  dims[3] = 2 * VPADDING + font->height;
+  XDrawRectangle(global.dpy, global.draw, global.xgc, dims[0], dims[1], dims[2], dims[3]);
+  XftDrawString8(global.xdraw, &global.ftblack, font,
+                 x + HPADDING, 2 * VPADDING + font->height - font->descent,
+                 (FcChar8 *)label, strlen(label));
+  return dims[2];
+}
+
+/** Draws application window contents.
+ */
+void paint_window()
+{
+  unsigned int width = global.winwidth, height = global.winheight;
+  unsigned int depth = DefaultDepth(global.dpy, XDefaultScreen(global.dpy));
+  DBG("Geometry (%u, %u)\n", width, height);
+
+  // Without DBE, render into a pixmap the size of the window.
+  if((global.backbuf == None) &&
+     ((global.pixmap == None) || (width != global.bufwidth) || (height != global.bufheight))) {
+    if(global.pixmap != None) {
+      XFreePixmap(global.dpy, global.pixmap);
+    }
+    global.pixmap = XCreatePixmap(global.dpy, global.win, width, height, depth);
+    global.draw = global.pixmap;
+    XftDrawChange(global.xdraw, global.draw);
+  }
+  global.bufwidth = width;
+  global.bufheight = height;
+
+  XGCValues gcvalues;
+  gcvalues.foreground = global.white.pixel;
+
+  XChangeGC(global.dpy, global.xgc, GCForeground, &gcvalues);
+  XFillRectangle(global.dpy, global.draw, global.xgc, 0, 0, width, height);
+
+  gcvalues.foreground = global.black.pixel;
+  XChangeGC(global.dpy, global.xgc, GCForeground, &gcvalues);
+
+  // Add a quit button
+  XftFont *font = XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
+                              FC_FAMILY, XftTypeString, TITLEFONT,
+                              FC_SIZE, XftTypeDouble, TITLEFONTSZ,
+                              NULL);
+  int w = draw_button(font, "Quit", HPADDING, global.quitdims);
+  int h = global.quitdims[3];
+
+  DBG_P("Quit button\n");
+
+  char *title = window_title();
+  if(title != NULL) {
+    XftDrawStringUtf8(global.xdraw, &global.ftblack, font,
+                      2 * HPADDING + w, 2 * VPADDING + font->height - font->descent,
+                      (FcChar8 *)title, strlen(title));
+  }
+
+  DBG_P("Title\n");
+
+  free(title);
+
+  // Lay out the grid, keeping the first visible font on screen.
+  // A matrix has a heading row naming its columns.
+  int offset = h + 2 * VPADDING;
+  int ncols = global.nmatrix > 1 ? global.nmatrix : 1;
+  int headh = ncols > 1 ? font->height + 2 * VPADDING : 0;
+  offset += headh;
+  int count = (args.maxfonts && (args.maxfonts < global.fs->nfont)) ? args.maxfonts : global.fs->nfont;
+  int laidout = 0;
+  if(!global.layoutvalid || (global.layout.width != width) ||
+     (global.layout.height != height - offset) || (global.layout.count != count)) {
+    int firstshown = global.page * global.layout.perpage;
+    laidout = compute_layout(&global.layout, width, height - offset, count, ncols);
+    global.layoutvalid = (laidout == 0);
+    if(laidout == 0) {
+      global.page = firstshown / global.layout.perpage;
+      if(global.page >= global.layout.npages)
+        global.page = global.layout.npages - 1;
+    }
+  }
+
+  memset(global.prevdims, 0, sizeof(global.prevdims));
+  memset(global.nextdims, 0, sizeof(global.nextdims));
+  if((laidout == 0) && (global.layout.npages > 1)) {
+    // Page controls, right aligned: "n/m [Prev] [Next]"
+    XGlyphInfo extents;
+    XftTextExtents8(global.dpy, font, (FcChar8 *)"Next", 4, &extents);
+    int nx = (int)width - 3 * HPADDING - extents.width;
+    XftTextExtents8(global.dpy, font, (FcChar8 *)"Prev", 4, &extents);
+    int px = nx - 3 * HPADDING - extents.width;
+    draw_button(font, "Next", nx, global.nextdims);
+    draw_button(font, "Prev", px, global.prevdims);
+
+    char pages[32];
+    snprintf(pages, sizeof(pages), "%d/%d", global.page + 1, global.layout.npages);
+    XftTextExtents8(global.dpy, font, (FcChar8 *)pages, strlen(pages), &extents);
+    XftDrawString8(global.xdraw, &global.ftblack, font,
+                   px - HPADDING - extents.width,
+                   2 * VPADDING + font->height - font->descent,
+                   (FcChar8 *)pages, strlen(pages));
+  }
+
+  if((laidout == 0) && (ncols > 1)) {
+    // Column headings, dropping the U+ if the columns are narrow.
+    const struct grid_layout *gl = &global.layout;
+    for(int c = 0; c < ncols; c++) {
+      char hex[11];
+      format_codepoint(hex, sizeof(hex), global.matrix[c]);
+      const char *label = hex;
+      XGlyphInfo extents;
+      XftTextExtents8(global.dpy, font, (FcChar8 *)label, strlen(label), &extents);
+      if(extents.width > gl->cw) {
+        label += 2;
+        XftTextExtents8(global.dpy, font, (FcChar8 *)label, strlen(label), &extents);
+      }
+      int x = gl->lw + c * gl->colw + HPADDING;
+      if(extents.width < gl->cw)
+        x += (gl->cw - extents.width) / 2;
+      queue_text(font, label, x, offset - VPADDING - font->descent);
+    }
+    flush_text();
+  }
+
+  XftFontClose(global.dpy, font);
+
+  // Draw the grid frame; characters are filled in by draw_cells().
+  global.cellsleft = 0;
+  if(laidout == 0) {
+    double start = stats_clock();
+    unsigned long req = XNextRequest(global.dpy);
+    generate_grid(&global.layout, offset);
+    global.gridpasses++;
+    if(args.stats) {
+      char phase[32];
+      snprintf(phase, sizeof(phase), "generate_grid #%d", global.gridpasses);
+      stats_phase(phase, start);
+      stats_count("  X requests", XNextRequest(global.dpy) - req);
+    }
+  }
+
+  global.bufvalid = 1;
+  show_buffer(0, 0, width, height);
+}
+
+/** Repaints the damaged part of the window.
+ *
+ * If the buffer still holds a render at the current size the
+ * damaged area is copied from it; otherwise everything is
+ * rendered again.
+ */
+void repaint_damage(Region damage)
+{
+  if(XEmptyRegion(damage)) {
+    return;
+  }
+
+  if(!global.dirty && buffer_current()) {
+    XRectangle box;
+    XClipBox(damage, &box);
+    DBG("copy damage (%d, %d) %u x %u\n", box.x, box.y, box.width, box.height);
+    show_buffer(box.x, box.y, box.width, box.height);
+  } else {
+    double start = trace_begin();
+    paint_window();
+    trace_end("paint_window", NULL, start);
+    global.dirty = 0;
+  }
+}
+
+
+/** Checks if the given coordinates are within
+ *  the bounds of a button.
+ */
+int check_bounds(const int dims[4], int x, int y)
+{
+    int dx = x - dims[0];
+    if((dx < 0) || (dx > dims[2]))
+      return 0;
+
+    int dy = y - dims[1];
+    if((dy < 0) || (dy > dims[3]))
+      return 0;
+
+    return 1;
+}
+
+/** Shows another page of the grid.
+ *
+ * \return Nonzero if the page changed.
+ */
+int goto_page(int page)
+{
+    if(page >= global.layout.npages)
+      page = global.layout.npages - 1;
+    if(page < 0)
+      page = 0;
+    if(page == global.page)
+      return 0;
+
+    DBG("page %d\n", page);
+    global.page = page;
+    global.dirty = 1;
+    return 1;
+}
+
+#endif
+
+/** Appends an inclusive range to the list of requested code points.
+ */
+int add_range(uint32_t first, uint32_t last)
+{
+  if((first > last) || (last > 0x10FFFF)) {
+    fprintf(stderr, "Invalid code point range U+%04X..U+%04X.\n", first, last);
+    return -1;
+  }
+
+  // Runs of single code points, as from --search, share a range.
+  if((global.nranges > 0) && (global.ranges[global.nranges - 1].last + 1 == first)) {
+    global.ranges[global.nranges - 1].last = last;
+    global.ncodepoints += last - first + 1;
+    return 0;
+  }
+
+  if(global.nranges == global.rangecap) {
+    int newcap = global.rangecap ? 2 * global.rangecap : 16;
+    struct cprange *r = (struct cprange *)realloc(global.ranges, newcap * sizeof(*r));
+    if(r == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    global.ranges = r;
+    global.rangecap = newcap;
+  }
+
+  global.ranges[global.nranges].first = first;
+  global.ranges[global.nranges].last = last;
+  global.nranges++;
+  global.ncodepoints += last - first + 1;
+
+  return 0;
+}
+
+/** Checks for a "0x", "0X" or "U+" hex prefix.
+ */
+int has_hex_prefix(const char *str)
+{
+  return (strncmp(str, "0x", 2) == 0) || (strncmp(str, "0X", 2) == 0) ||
+         (strncmp(str, "U+", 2) == 0);
+}
+
+/** Adds the code points given by one argument: a hex code
+ *  (0x20AC or U+20AC), a range (U+XXXX..U+YYYY), a comma separated
+ *  list of those, or characters in the locale's encoding.
+ *
+ * Every character of a string is added, so combining sequences
+ * are looked up one code point at a time.
+ *
+ * \return Zero on success, negative on error.
+ */
+int parse_character(char *cchar)
+{
+  uint32_t first = 0;
+  int before = global.nranges;
+
+  if(has_hex_prefix(cchar)) {
+    char *comma = strchr(cchar, ',');
+    if(comma != NULL) {
+      *comma = '\0';
+      int ret = parse_character(cchar);
+      *comma = ',';
+      if((ret < 0) || (comma[1] == '\0')) {
+        return ret;
+      }
+      return parse_character(comma + 1);
+    }
+
+    char *end;
+    uint32_t last;
+    first = (uint32_t)strtol(cchar + 2, &end, 16);
+    last = first;
+    if(strncmp(end, "..", 2) == 0) {
+      end += 2;
+      if(has_hex_prefix(end)) {
+        end += 2;
+      }
+      last = (uint32_t)strtol(end, &end, 16);
+    }
+    if((end == cchar + 2) || (*end != '\0')) {
+      fprintf(stderr, "Invalid code point '%s'.\n", cchar);
+      return -1;
+    }
+    if(add_range(first, last) < 0) {
+      return -1;
+    }
+  } else {
+    // Most arguments are a character or two; avoid the heap for them.
+    uint32_t small[64];
+    size_t len = strlen(cchar);
+    uint32_t *cps = small;
+    if(len > sizeof(small) / sizeof(small[0])) {
+      cps = (uint32_t *)malloc(len * sizeof(uint32_t));
+      if(cps == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+      }
+    }
+
+    int n = decode_locale_string(cchar, cps);
+    if(n == 0) {
+      fprintf(stderr, "No character given in '%s'.\n", cchar);
+    }
+    int ret = n > 0 ? 0 : -1;
+    for(int i = 0; (ret == 0) && (i < n); i++) {
+      ret = add_range(cps[i], cps[i]);
+    }
+    if(n > 0)
+      first = cps[0];
+    if(cps != small) {
+      free(cps);
+    }
+    if(ret < 0) {
+      return -1;
+    }
+  }
+
+  // The first character given is the one displayed.
+  if(before == 0) {
+    global.character = first;
+    format_codepoint(global.hexchar, sizeof(global.hexchar), first);
+  }
+
+  return 0;
+}
+
+/** Reads whitespace or comma separated characters,
+ *  code points and ranges from a file.
+ *
+ *  Everything after a '#' on a line is ignored.
+ */
+int parse_character_file(const char *path)
+{
+  FILE *fp = stdin;
+  if(strcmp(path, "-") != 0) {
+    fp = fopen(path, "r");
+    if(fp == NULL) {
+      fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+
+  char *line = NULL;
+  size_t linesz = 0;
+  int ret = 0;
+  while((ret == 0) && (getline(&line, &linesz, fp) >= 0)) {
+    char *comment = strchr(line, '#');
+    if(comment != NULL) {
+      *comment = '\0';
+    }
+
+    char *saveptr;
+    for(char *tok = strtok_r(line, " \t\r\n,", &saveptr); tok != NULL;
+        tok = strtok_r(NULL, " \t\r\n,", &saveptr)) {
+      if(parse_character(tok) < 0) {
+        ret = -1;
+        break;
+      }
+    }
+  }
+
+  free(line);
+  if(fp != stdin) {
+    fclose(fp);
+  }
+
+  return ret;
+}
+
+/** Adds the code points of the Unicode block called name,
+ *  compared without case, to the requested ones.
+ *
+ * \return Zero on success, negative on error.
+ */
+int add_block(const char *name)
+{
+#ifdef HAVE_UNINAMESLIST_BLOCKCOUNT
+  int before = global.nranges;
+  int nblocks = uniNamesList_blockCount();
+  for(int b = 0; b < nblocks; b++) {
+    if(strcasecmp(uniNamesList_blockNameList(b), name) != 0)
+      continue;
+    uint32_t first = (uint32_t)uniNamesList_blockStart(b);
+    if(add_range(first, (uint32_t)uniNamesList_blockEnd(b)) < 0) {
+      return -1;
+    }
+    if(before == 0) {
+      global.character = first;
+      format_codepoint(global.hexchar, sizeof(global.hexchar), first);
+    }
+    return 0;
+  }
+  fprintf(stderr, "No Unicode block named '%s'.\n", name);
+#else
+  fprintf(stderr, "This libuninameslist has no Unicode block information.\n");
+#endif
+  return -1;
+}
+
+// Code points tested per pass over the font set in batch mode.
+#define SCANBLOCK 1024
+
+// Coverage results for one worker's contiguous slice of the candidate fonts.
+struct scan_slice {
+  int first;            // First font in slice
+  int last;             // One past the last font in slice
+  unsigned char *hits;  // Font-major flags, SCANBLOCK per font
+};
+
+// Pool of threads sharing each charset scan.
+struct {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  pthread_t *threads;
+  struct scan_slice *slices;
+  int nslices;          // Slice zero is scanned by the calling thread
+  unsigned long generation;
+  int pending;
+  int quit;
+  const uint32_t *cps;  // Code points being scanned
+  int ncps;
+} pool;
+
+/** Tests every code point of the current scan against one slice of fonts.
+ */
+void scan_slice(struct scan_slice *sl, const uint32_t *cps, int ncps)
+{
+  unsigned char *row = sl->hits;
+  for(int f = sl->first; f < sl->last; f++, row += SCANBLOCK) {
+    const FcCharSet *cs = global.charsets[f];
+    if(cs == NULL) {
+      memset(row, 0, ncps);
+      continue;
+    }
+    for(int k = 0; k < ncps; k++) {
+      row[k] = FcCharSetHasChar(cs, cps[k]);
+    }
+  }
+}
+
+void *scan_worker(void *arg)
+{
+  struct scan_slice *sl = (struct scan_slice *)arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  while(1) {
+    while((pool.generation == seen) && !pool.quit) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    if(pool.quit) {
+      break;
+    }
+    seen = pool.generation;
+    const uint32_t *cps = pool.cps;
+    int ncps = pool.ncps;
+    pthread_mutex_unlock(&pool.lock);
+
+    scan_slice(sl, cps, ncps);
+
+    pthread_mutex_lock(&pool.lock);
+    if(--pool.pending == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  return NULL;
+}
+
+/** Returns how many threads to run, -j if given and else one
+ *  per CPU.
+ */
+int default_jobs()
+{
+  if(args.jobs > 0)
+    return args.jobs;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return ncpu > 0 ? (int)ncpu : 1;
+}
+
+/** Splits the candidate fonts into slices and starts
+ *  one worker thread per slice after the first.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int start_pool()
+{
+  int jobs = default_jobs();
+  if(jobs > global.allfs->nfont) {
+    jobs = global.allfs->nfont > 0 ? global.allfs->nfont : 1;
+  }
+
+  pool.slices = (struct scan_slice *)calloc(jobs, sizeof(*pool.slices));
+  pool.threads = (pthread_t *)calloc(jobs, sizeof(*pool.threads));
+  if((pool.slices == NULL) || (pool.threads == NULL)) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+
+  for(int t = 0; t < jobs; t++) {
+    struct scan_slice *sl = &pool.slices[t];
+    sl->first = (int)((long)global.allfs->nfont * t / jobs);
+    sl->last = (int)((long)global.allfs->nfont * (t + 1) / jobs);
+    sl->hits = (unsigned char *)malloc((size_t)(sl->last - sl->first + 1) * SCANBLOCK);
+    if(sl->hits == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    if((t > 0) && (pthread_create(&pool.threads[t], NULL, scan_worker, sl) != 0)) {
+      fprintf(stderr, "Could not start scan thread: %s\n", strerror(errno));
+      return -1;
+    }
+    pool.nslices = t + 1;
+  }
+
+  DBG("Scanning %d fonts with %d threads\n", global.allfs->nfont, jobs);
+
+  return 0;
+}
+
+/** Stops the worker threads and frees their buffers.
+ */
+void stop_pool()
+{
+  if(pool.slices == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+
+  for(int t = 1; t < pool.nslices; t++) {
+    pthread_join(pool.threads[t], NULL);
+  }
+  for(int t = 0; t < pool.nslices; t++) {
+    free(pool.slices[t].hits);
+  }
+  free(pool.slices);
+  free(pool.threads);
+  pool.slices = NULL;
+  pool.threads = NULL;
+  // Ready for start_pool() again, as after a --watch update.
+  pool.nslices = 0;
+  pool.generation = 0;
+  pool.quit = 0;
+
+  pthread_cond_destroy(&pool.done);
+  pthread_cond_destroy(&pool.start);
+  pthread_mutex_destroy(&pool.lock);
+}
+
+/** Tests up to SCANBLOCK code points against every candidate font,
+ *  sharing the fonts out among the pool's threads.
+ */
+void scan_codepoints(const uint32_t *cps, int ncps)
+{
+  if(pool.nslices > 1) {
+    pthread_mutex_lock(&pool.lock);
+    pool.cps = cps;
+    pool.ncps = ncps;
+    pool.pending = pool.nslices - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  scan_slice(&pool.slices[0], cps, ncps);
+
+  if(pool.nslices > 1) {
+    pthread_mutex_lock(&pool.lock);
+    while(pool.pending > 0) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+/** Initializes fontconfig the first time it is needed.
+ *
+ * Queries answered from a valid index never load the
+ * fontconfig configuration.
+ */
+void init_fontconfig()
+{
+  if(!global.fcinit) {
+    double start = stats_clock();
+    FcInit();
+    global.fcinit = 1;
+    stats_phase("FcInit", start);
+  }
+}
+
+/** Makes a font set the candidate fonts, taking ownership of it.
+ */
+int use_fonts(FcFontSet *fs)
+{
+    global.allfs = fs;
+    global.charsets = (FcCharSet **)calloc(global.allfs->nfont + 1, sizeof(FcCharSet *));
+    if(global.charsets == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    for(int i = 0; i < global.allfs->nfont; i++) {
+      FcPatternGetCharSet(global.allfs->fonts[i], FC_CHARSET, 0, &global.charsets[i]);
+    }
+
+    return start_pool();
+}
+
+/** Lists every candidate font once, keeping its
+ *  charset so code points can be tested in memory.
+ */
+int load_fonts()
+{
+    init_fontconfig();
+    FcPattern *pat = FcPatternCreate();
+
+    if(!args.fixed) {
+      FcPatternAddBool(pat, FC_SCALABLE, FcTrue);
+    }
+
+    FcObjectSet *os = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_FILE, FC_INDEX, FC_CHARSET, (char *)0);
+
+    FcFontSet *fs = FcFontList(0, pat, os);
+
+    FcObjectSetDestroy(os);
+    FcPatternDestroy(pat);
+
+    if(fs == NULL) {
+      fprintf(stderr, "Could not list fonts.\n");
+      return -1;
+    }
+
+    return use_fonts(fs);
+}
+
+/** Frees the candidate font list.
+ */
+void free_fonts()
+{
+    stop_pool();
+    free(global.charsets);
+    global.charsets = NULL;
+    if(global.allfs != NULL) {
+      FcFontSetDestroy(global.allfs);
+      global.allfs = NULL;
+    }
+}
+
+/** Checks if a candidate font contains a character.
+ */
+int font_has_char(int font, uint32_t character)
+{
+    return (global.charsets[font] != NULL) &&
+           FcCharSetHasChar(global.charsets[font], character);
+}
+
+/** Fills in the description of a font from its pattern.
+ */
+void pattern_fontinfo(FcPattern *pat, int id, struct fontinfo *fi)
+{
+    FcChar8 *str;
+
+    fi->id = id;
+    fi->family = (FcPatternGetString(pat, FC_FAMILY, 0, &str) == FcResultMatch) ? (char *)str : "";
+    fi->style = (FcPatternGetString(pat, FC_STYLE, 0, &str) == FcResultMatch) ? (char *)str : "";
+    fi->file = (FcPatternGetString(pat, FC_FILE, 0, &str) == FcResultMatch) ? (char *)str : "";
+    if(FcPatternGetInteger(pat, FC_INDEX, 0, &fi->index) != FcResultMatch) {
+      fi->index = 0;
+    }
+}
+
+/** Fills in the description of a candidate font.
+ */
+void get_fontinfo(int font, struct fontinfo *fi)
+{
+    pattern_fontinfo(global.allfs->fonts[font], font, fi);
+}
+
+// Reverse index file layout. All sections are 8 byte aligned and
+// all offsets are from the start of the file.
+#define INDEX_MAGIC "FCCHIDX"
+#define INDEX_VERSION 1
+// Font was listed as scalable.
+#define INDEX_SCALABLE 0x1
+
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;         // Total file size
+  uint32_t env;          // Fontconfig environment the index was built with
+  uint32_t nstamps;
+  uint32_t nfonts;
+  uint32_t npages;
+  uint32_t stamps_off;   // struct index_stamp[nstamps]
+  uint32_t fonts_off;    // struct index_font[nfonts]
+  uint32_t pages_off;    // struct index_page[npages], sorted by page
+  uint32_t posts_off;    // struct index_posting[], grouped by page
+  uint32_t strings_off;  // NUL terminated strings
+  uint32_t strings_size;
+};
+
+// Modification time of a fontconfig directory or file.
+struct index_stamp {
+  uint32_t path;
+  uint32_t exists;
+  int64_t sec;
+  int64_t nsec;
+};
+
+struct index_font {
+  uint32_t family;
+  uint32_t style;
+  uint32_t file;
+  int32_t index;
+  uint32_t flags;
+};
+
+// Fonts with at least one code point in page (code point >> 8).
+struct index_page {
+  uint32_t page;
+  uint32_t first;
+  uint32_t count;
+};
+
+struct index_posting {
+  uint32_t font;
+  FcChar32 leaf[8];
+};
+
+/** Appends a string, returning its offset or -1 on error.
+ */
+long strbuf_add(struct strbuf *sb, const char *str)
+{
+  size_t n = strlen(str) + 1;
+  if(sb->len + n > sb->cap) {
+    size_t newcap = sb->cap ? 2 * sb->cap : 4096;
+    while(newcap < sb->len + n)
+      newcap *= 2;
+    char *d = (char *)realloc(sb->data, newcap);
+    if(d == NULL) {
+      return -1;
+    }
+    sb->data = d;
+    sb->cap = newcap;
+  }
+  memcpy(sb->data + sb->len, str, n);
+  sb->len += n;
+  return (long)(sb->len - n);
+}
+
+/** Determines where a cache file such as the reverse index is kept.
+ *
+ * \return Zero on success, negative if no cache directory is known.
+ */
+int index_path(char *path, size_t size, const char *file, int mkdirs)
+{
+  const char *cache = getenv("XDG_CACHE_HOME");
+  int n;
+  if((cache != NULL) && (cache[0] == '/')) {
+    n = snprintf(path, size, "%s", cache);
+  } else {
+    const char *home = getenv("HOME");
+    if(home == NULL) {
+      return -1;
+    }
+    n = snprintf(path, size, "%s/.cache", home);
+  }
+  if((n < 0) || ((size_t)n >= size)) {
+    return -1;
+  }
+
+  if(mkdirs) {
+    mkdir(path, 0700);
+  }
+  n += snprintf(path + n, size - n, "/fc-char");
+  if(mkdirs) {
+    mkdir(path, 0700);
+  }
+  n += snprintf(path + n, size - n, "/%s", file);
+
+  return ((size_t)n < size) ? 0 : -1;
+}
+
+/** Describes the fontconfig environment variables that select
+ *  a configuration, so a different setup does not reuse the index.
+ */
+void index_env(char *buf, size_t size)
+{
+  const char *file = getenv("FONTCONFIG_FILE");
+  const char *path = getenv("FONTCONFIG_PATH");
+  const char *sysroot = getenv("FONTCONFIG_SYSROOT");
+  snprintf(buf, size, "%s\n%s\n%s", file ? file : "", path ? path : "",
+           sysroot ? sysroot : "");
+}
+
+/** Records modification times for every entry of a fontconfig string list.
+ */
+int index_add_stamps(struct strbuf *sb, struct index_stamp **stamps,
+                     uint32_t *nstamps, size_t *cap, FcStrList *list)
+{
+  if(list == NULL) {
+    return 0;
+  }
+
+  FcChar8 *path;
+  while((path = FcStrListNext(list)) != NULL) {
+    if(*nstamps == *cap) {
+      size_t newcap = *cap ? 2 * *cap : 64;
+      struct index_stamp *s = (struct index_stamp *)realloc(*stamps, newcap * sizeof(*s));
+      if(s == NULL) {
+        FcStrListDone(list);
+        return -1;
+      }
+      *stamps = s;
+      *cap = newcap;
+    }
+
+    struct index_stamp *st = &(*stamps)[*nstamps];
+    long off = strbuf_add(sb, (char *)path);
+    if(off < 0) {
+      FcStrListDone(list);
+      return -1;
+    }
+    struct stat sbuf;
+    memset(st, 0, sizeof(*st));
+    st->path = (uint32_t)off;
+    if(stat((char *)path, &sbuf) == 0) {
+      st->exists = 1;
+      st->sec = sbuf.st_mtim.tv_sec;
+      st->nsec = sbuf.st_mtim.tv_nsec;
+    }
+    (*nstamps)++;
+  }
+  FcStrListDone(list);
+
+  return 0;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+/** Writes a file through a temporary one, so readers see either
+ *  the old contents or all of the new.
+ *
+ * \return Zero on success, negative on error.
+ */
+int replace_file(const char *path, const char *buf, size_t size)
+{
+  char *tmppath = (char *)malloc(strlen(path) + 8);
+  if(tmppath == NULL)
+    return -1;
+  sprintf(tmppath, "%s.XXXXXX", path);
+  int fd = mkstemp(tmppath);
+  if(fd < 0) {
+    free(tmppath);
+    return -1;
+  }
+
+  size_t written = 0;
+  while(written < size) {
+    ssize_t n = write(fd, buf + written, size - written);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+    written += n;
+  }
+
+  int ret = -1;
+  if((close(fd) == 0) && (written == size) && (rename(tmppath, path) == 0)) {
+    ret = 0;
+  } else {
+    unlink(tmppath);
+  }
+  free(tmppath);
+  return ret;
+}
+
+// A font posting together with its page, before pages are laid out.
+struct index_entry {
+  uint32_t page;
+  struct index_posting post;
+};
+
+// Fonts and postings gathered for a new reverse index.
+struct index_draft {
+  struct strbuf sb;
+  struct index_font *fonts;
+  uint32_t nfonts;
+  size_t fontcap;
+  struct index_entry *entries;
+  size_t nentries;
+  size_t entrycap;
+};
+
+/** Frees a draft index.
+ */
+void draft_free(struct index_draft *d)
+{
+  free(d->sb.data);
+  free(d->fonts);
+  free(d->entries);
+  memset(d, 0, sizeof(*d));
+}
+
+/** Adds a font's description to a draft index.
+ *
+ * \return The font's number, negative if out of memory.
+ */
+long draft_add_font(struct index_draft *d, const char *family, const char *style,
+                    const char *file, int32_t index, uint32_t flags)
+{
+  // Offset zero is reserved for the empty string.
+  if((d->sb.len == 0) && (strbuf_add(&d->sb, "") < 0))
+    return -1;
+  if(d->nfonts == d->fontcap) {
+    size_t newcap = d->fontcap ? 2 * d->fontcap : 256;
+    struct index_font *f = (struct index_font *)realloc(d->fonts, newcap * sizeof(*f));
+    if(f == NULL)
+      return -1;
+    d->fonts = f;
+    d->fontcap = newcap;
+  }
+
+  long family_off, style_off, file_off;
+  if(((family_off = strbuf_add(&d->sb, family)) < 0) ||
+     ((style_off = strbuf_add(&d->sb, style)) < 0) ||
+     ((file_off = strbuf_add(&d->sb, file)) < 0))
+    return -1;
+
+  struct index_font *f = &d->fonts[d->nfonts];
+  f->family = (uint32_t)family_off;
+  f->style = (uint32_t)style_off;
+  f->file = (uint32_t)file_off;
+  f->index = index;
+  f->flags = flags;
+  return d->nfonts++;
+}
+
+/** Adds one charset page of a font to a draft index.
+ *
+ * \return Zero on success, negative if out of memory.
+ */
+int draft_add_page(struct index_draft *d, uint32_t font, uint32_t page, const FcChar32 *leaf)
+{
+  if(page >= 0x1100)
+    return 0;
+  if(d->nentries == d->entrycap) {
+    size_t newcap = d->entrycap ? 2 * d->entrycap : 4096;
+    struct index_entry *e = (struct index_entry *)realloc(d->entries, newcap * sizeof(*e));
+    if(e == NULL)
+      return -1;
+    d->entries = e;
+    d->entrycap = newcap;
+  }
+
+  struct index_entry *e = &d->entries[d->nentries++];
+  e->page = page;
+  e->post.font = font;
+  memcpy(e->post.leaf, leaf, sizeof(e->post.leaf));
+  return 0;
+}
+
+/** Adds a font listed by fontconfig, with its charset, to a draft index.
+ *
+ * \return Zero on success, negative if out of memory.
+ */
+int draft_add_pattern(struct index_draft *d, FcPattern *pat)
+{
+  FcChar8 *family, *style, *file;
+  FcBool scalable;
+  int index;
+  if(FcPatternGetString(pat, FC_FAMILY, 0, &family) != FcResultMatch)
+    family = (FcChar8 *)"";
+  if(FcPatternGetString(pat, FC_STYLE, 0, &style) != FcResultMatch)
+    style = (FcChar8 *)"";
+  if(FcPatternGetString(pat, FC_FILE, 0, &file) != FcResultMatch)
+    file = (FcChar8 *)"";
+  if(FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+    index = 0;
+  uint32_t flags = 0;
+  if((FcPatternGetBool(pat, FC_SCALABLE, 0, &scalable) == FcResultMatch) && scalable)
+    flags |= INDEX_SCALABLE;
+
+  long font = draft_add_font(d, (char *)family, (char *)style, (char *)file, index, flags);
+  if(font < 0)
+    return -1;
+
+  FcCharSet *cs;
+  if(FcPatternGetCharSet(pat, FC_CHARSET, 0, &cs) != FcResultMatch)
+    return 0;
+
+  FcChar32 map[FC_CHARSET_MAP_SIZE], next;
+  for(FcChar32 base = FcCharSetFirstPage(cs, map, &next); base != FC_CHARSET_DONE;
+      base = FcCharSetNextPage(cs, map, &next)) {
+    if(draft_add_page(d, (uint32_t)font, base >> 8, map) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/** Lays out a draft index page by page and writes it to the cache,
+ *  with the current fontconfig files and directories as stamps.
+ *
+ * Postings keep the order they were added in within each page, so
+ * fonts added in order stay sorted.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int write_index(struct index_draft *d)
+{
+  char path[4096];
+  if(index_path(path, sizeof(path), "index", 1) < 0) {
+    return -1;
+  }
+
+  int ret = -1;
+  struct index_stamp *stamps = NULL;
+  uint32_t nstamps = 0;
+  size_t stampcap = 0;
+  uint32_t *pagecount = NULL;
+  struct index_page *pages = NULL;
+  struct index_posting *posts = NULL;
+
+  char env[4096];
+  index_env(env, sizeof(env));
+  long envoff;
+  if(((d->sb.len == 0) && (strbuf_add(&d->sb, "") < 0)) ||
+     ((envoff = strbuf_add(&d->sb, env)) < 0))
+    goto done;
+
+  FcConfig *config = FcConfigGetCurrent();
+  if((index_add_stamps(&d->sb, &stamps, &nstamps, &stampcap, FcConfigGetConfigFiles(config)) < 0) ||
+     (index_add_stamps(&d->sb, &stamps, &nstamps, &stampcap, FcConfigGetFontDirs(config)) < 0) ||
+     (index_add_stamps(&d->sb, &stamps, &nstamps, &stampcap, FcConfigGetCacheDirs(config)) < 0))
+    goto done;
+
+  // Count fonts per page, then lay postings out page by page.
+  pagecount = (uint32_t *)calloc(0x1100, sizeof(*pagecount));
+  if(pagecount == NULL)
+    goto done;
+  for(size_t i = 0; i < d->nentries; i++) {
+    pagecount[d->entries[i].page]++;
+  }
+
+  uint32_t npages = 0;
+  for(int p = 0; p < 0x1100; p++) {
+    if(pagecount[p])
+      npages++;
+  }
+
+  pages = (struct index_page *)calloc(npages + 1, sizeof(*pages));
+  posts = (struct index_posting *)calloc(d->nentries + 1, sizeof(*posts));
+  if((pages == NULL) || (posts == NULL))
+    goto done;
+
+  // Page number to slot in pages[], reusing the count array.
+  uint32_t slot = 0, first = 0;
+  for(int p = 0; p < 0x1100; p++) {
+    if(pagecount[p]) {
+      pages[slot].page = p;
+      pages[slot].first = first;
+      first += pagecount[p];
+      pagecount[p] = slot++;
+    }
+  }
+
+  for(size_t i = 0; i < d->nentries; i++) {
+    struct index_page *pg = &pages[pagecount[d->entries[i].page]];
+    posts[pg->first + pg->count++] = d->entries[i].post;
+  }
+
+  struct index_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = INDEX_VERSION;
+  hdr.env = (uint32_t)envoff;
+  hdr.nstamps = nstamps;
+  hdr.nfonts = d->nfonts;
+  hdr.npages = npages;
+  hdr.stamps_off = ALIGN8(sizeof(hdr));
+  hdr.fonts_off = ALIGN8(hdr.stamps_off + nstamps * sizeof(*stamps));
+  hdr.pages_off = ALIGN8(hdr.fonts_off + d->nfonts * sizeof(*d->fonts));
+  hdr.posts_off = ALIGN8(hdr.pages_off + npages * sizeof(*pages));
+  hdr.strings_off = ALIGN8(hdr.posts_off + d->nentries * sizeof(*posts));
+  hdr.strings_size = d->sb.len;
+  size_t total = ALIGN8((size_t)hdr.strings_off + d->sb.len);
+  if(total > UINT32_MAX)
+    goto done;
+  hdr.size = (uint32_t)total;
+
+  // Write everything into one buffer so the file appears atomically.
+  char *buf = (char *)calloc(1, total);
+  if(buf == NULL)
+    goto done;
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + hdr.stamps_off, stamps, nstamps * sizeof(*stamps));
+  memcpy(buf + hdr.fonts_off, d->fonts, d->nfonts * sizeof(*d->fonts));
+  memcpy(buf + hdr.pages_off, pages, npages * sizeof(*pages));
+  memcpy(buf + hdr.posts_off, posts, d->nentries * sizeof(*posts));
+  memcpy(buf + hdr.strings_off, d->sb.data, d->sb.len);
+
+  if(replace_file(path, buf, total) == 0) {
+    DBG("Wrote index %s: %u fonts, %u pages\n", path, d->nfonts, npages);
+    ret = 0;
+  }
+  free(buf);
+
+done:
+  free(posts);
+  free(pages);
+  free(pagecount);
+  free(stamps);
+
+  return ret;
+}
+
+/** Lists all fonts and writes the reverse index to the cache.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int build_index()
+{
+  init_fontconfig();
+
+  FcPattern *pat = FcPatternCreate();
+  FcObjectSet *os = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_FILE, FC_INDEX,
+                                     FC_SCALABLE, FC_CHARSET, (char *)0);
+  FcFontSet *fs = FcFontList(0, pat, os);
+  FcObjectSetDestroy(os);
+  FcPatternDestroy(pat);
+  if(fs == NULL) {
+    return -1;
+  }
+
+  struct index_draft d;
+  memset(&d, 0, sizeof(d));
+  int ret = 0;
+  for(int i = 0; (ret == 0) && (i < fs->nfont); i++) {
+    ret = draft_add_pattern(&d, fs->fonts[i]);
+  }
+  if(ret == 0) {
+    ret = write_index(&d);
+  }
+  draft_free(&d);
+  FcFontSetDestroy(fs);
+
+  return ret;
+}
+
+/** Unmaps the reverse index.
+ */
+void close_index()
+{
+  if(global.index != NULL) {
+    munmap((void *)global.index, global.indexsize);
+    global.index = NULL;
+  }
+}
+
+/** Returns a string stored in the reverse index.
+ */
+const char *index_string(uint32_t off)
+{
+  if(off >= global.index->strings_size) {
+    return "";
+  }
+  return (const char *)global.index + global.index->strings_off + off;
+}
+
+/** Maps the cached reverse index if it was built for the
+ *  current fontconfig environment, without checking it is current.
+ *
+ * \return Zero on success, negative if missing or invalid.
+ */
+int map_index()
+{
+  char path[4096];
+  if(index_path(path, sizeof(path), "index", 0) < 0) {
+    return -1;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return -1;
+  }
+
+  struct stat sbuf;
+  if((fstat(fd, &sbuf) < 0) || (sbuf.st_size < (off_t)sizeof(struct index_header))) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    return -1;
+  }
+
+  const struct index_header *hdr = (const struct index_header *)map;
+  const char *base = (const char *)map;
+  if((memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0) ||
+     (hdr->version != INDEX_VERSION) || (hdr->size != (uint64_t)sbuf.st_size) ||
+     ((uint64_t)hdr->strings_off + hdr->strings_size > hdr->size) ||
+     ((uint64_t)hdr->stamps_off + hdr->nstamps * sizeof(struct index_stamp) > hdr->strings_off) ||
+     ((uint64_t)hdr->fonts_off + hdr->nfonts * sizeof(struct index_font) > hdr->strings_off) ||
+     ((uint64_t)hdr->pages_off + hdr->npages * sizeof(struct index_page) > hdr->posts_off) ||
+     (hdr->posts_off > hdr->strings_off) ||
+     (hdr->strings_size == 0) || (base[hdr->strings_off + hdr->strings_size - 1] != '\0')) {
+    DBG("Index %s is invalid\n", path);
+    munmap(map, sbuf.st_size);
+    return -1;
+  }
+
+  global.index = hdr;
+  global.indexsize = sbuf.st_size;
+
+  char env[4096];
+  index_env(env, sizeof(env));
+  if((hdr->env >= hdr->strings_size) || (strcmp(index_string(hdr->env), env) != 0)) {
+    close_index();
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Maps the cached reverse index if it is still valid.
+ *
+ * \return Zero on success, negative if missing or stale.
+ */
+int open_index()
+{
+  if(map_index() < 0) {
+    return -1;
+  }
+
+  const struct index_header *hdr = global.index;
+  const char *base = (const char *)hdr;
+  int stale = 0;
+  const struct index_stamp *stamps = (const struct index_stamp *)(base + hdr->stamps_off);
+  for(uint32_t i = 0; !stale && (i < hdr->nstamps); i++) {
+    struct stat st;
+    int exists = (stat(index_string(stamps[i].path), &st) == 0);
+    if((exists != (int)stamps[i].exists) ||
+       (exists && ((st.st_mtim.tv_sec != stamps[i].sec) ||
+                   (st.st_mtim.tv_nsec != stamps[i].nsec)))) {
+      DBG("Index stale: %s changed\n", index_string(stamps[i].path));
+      stale = 1;
+    }
+  }
+
+  if(stale) {
+    close_index();
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Rewrites the cached reverse index with the fonts of some files
+ *  replaced, reusing the postings of every other font.
+ *
+ * The new index replaces the old file in one rename, so processes
+ * that have the old one mapped keep a consistent view of it.
+ *
+ * \param files Files whose fonts are dropped from the index.
+ * \param added Fonts to add, usually those now in the files.
+ * \return Zero on success, negative if there was no index to patch.
+ */
+int patch_index(char *const *files, int nfiles, const FcFontSet *added)
+{
+  if(map_index() < 0) {
+    return -1;
+  }
+
+  const char *base = (const char *)global.index;
+  const struct index_font *fonts = (const struct index_font *)(base + global.index->fonts_off);
+  const struct index_page *pages = (const struct index_page *)(base + global.index->pages_off);
+  const struct index_posting *posts = (const struct index_posting *)(base + global.index->posts_off);
+  uint64_t maxposts = (global.index->strings_off - global.index->posts_off) / sizeof(*posts);
+
+  struct index_draft d;
+  memset(&d, 0, sizeof(d));
+  int ret = -1;
+  uint32_t nfonts = global.index->nfonts;
+  long *renumber = (long *)malloc((nfonts + 1) * sizeof(long));
+  if(renumber == NULL)
+    goto done;
+
+  // Old fonts keep their order, less those from changed files.
+  for(uint32_t f = 0; f < nfonts; f++) {
+    const char *file = index_string(fonts[f].file);
+    renumber[f] = -1;
+    int changed = 0;
+    for(int i = 0; !changed && (i < nfiles); i++) {
+      changed = (strcmp(file, files[i]) == 0);
+    }
+    if(changed)
+      continue;
+    renumber[f] = draft_add_font(&d, index_string(fonts[f].family), index_string(fonts[f].style),
+                                 file, fonts[f].index, fonts[f].flags);
+    if(renumber[f] < 0)
+      goto done;
+  }
+
+  for(uint32_t p = 0; p < global.index->npages; p++) {
+    if((uint64_t)pages[p].first + pages[p].count > maxposts)
+      continue;
+    const struct index_posting *post = &posts[pages[p].first];
+    for(uint32_t i = 0; i < pages[p].count; i++, post++) {
+      if((post->font < nfonts) && (renumber[post->font] >= 0) &&
+         (draft_add_page(&d, (uint32_t)renumber[post->font], pages[p].page, post->leaf) < 0))
+        goto done;
+    }
+  }
+
+  for(int i = 0; i < added->nfont; i++) {
+    if(draft_add_pattern(&d, added->fonts[i]) < 0)
+      goto done;
+  }
+
+  close_index();
+  ret = write_index(&d);
+
+done:
+  close_index();
+  free(renumber);
+  draft_free(&d);
+  return ret;
+}
+
+/** Fills in the description of an indexed font.
+ *
+ * \return Zero on success, negative if the font isn't selected.
+ */
+int index_fontinfo(uint32_t font, struct fontinfo *fi)
+{
+  const char *base = (const char *)global.index;
+  const struct index_font *f = (const struct index_font *)(base + global.index->fonts_off) + font;
+  if((font >= global.index->nfonts) || (!args.fixed && !(f->flags & INDEX_SCALABLE))) {
+    return -1;
+  }
+
+  fi->id = font;
+  fi->family = index_string(f->family);
+  fi->style = index_string(f->style);
+  fi->file = index_string(f->file);
+  fi->index = f->index;
+  return 0;
+}
+
+/** Uses the reverse index to find fonts containing a character.
+ *
+ * \param fonts Destination array, at least nfonts entries long.
+ * \return Number of fonts found.
+ */
+int index_collect_fonts(uint32_t character, struct fontinfo *fonts, int nfonts)
+{
+  const char *base = (const char *)global.index;
+  const struct index_page *pages = (const struct index_page *)(base + global.index->pages_off);
+  const struct index_font *ifonts = (const struct index_font *)(base + global.index->fonts_off);
+  const struct index_posting *posts = (const struct index_posting *)(base + global.index->posts_off);
+  uint64_t maxposts = (global.index->strings_off - global.index->posts_off) / sizeof(*posts);
+
+  uint32_t page = character >> 8;
+  uint32_t lo = 0, hi = global.index->npages;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(pages[mid].page < page)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if((lo == global.index->npages) || (pages[lo].page != page) ||
+     ((uint64_t)pages[lo].first + pages[lo].count > maxposts)) {
+    return 0;
+  }
+
+  int found = 0;
+  FcChar32 bit = (FcChar32)1 << (character & 0x1f);
+  int word = (character & 0xff) >> 5;
+  const struct index_posting *post = &posts[pages[lo].first];
+  for(uint32_t i = 0; (i < pages[lo].count) && (found < nfonts); i++, post++) {
+    if(!(post->leaf[word] & bit) || (post->font >= global.index->nfonts))
+      continue;
+
+    if(!args.fixed && !(ifonts[post->font].flags & INDEX_SCALABLE))
+      continue;
+
+    index_fontinfo(post->font, &fonts[found++]);
+  }
+
+  return found;
+}
+
+// Cached trigram index of Unicode names and annotations, for
+// --search. Trigrams are of ASCII upper cased bytes and are looked
+// up by binary search; each lists the code points whose name or
+// annotation contains it, in increasing order.
+#define NAMES_MAGIC "FCCHNAM"
+#define NAMES_VERSION 1
+
+struct names_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;         // Total file size
+  char libversion[32];   // libuninameslist the index was built from
+  uint32_t ntrigrams;
+  uint32_t trigrams_off; // struct names_trigram[ntrigrams], sorted by key
+  uint32_t nposts;
+  uint32_t posts_off;    // uint32_t code points, grouped by trigram
+};
+
+struct names_trigram {
+  uint32_t key;
+  uint32_t first;
+  uint32_t count;
+};
+
+/** Upper cases an ASCII byte, leaving others alone.
+ */
+unsigned char name_fold(unsigned char c)
+{
+  return ((c >= 'a') && (c <= 'z')) ? c - 'a' + 'A' : c;
+}
+
+/** Describes the names library, so a new one rebuilds the index.
+ */
+void names_version(char *buf, size_t size)
+{
+  memset(buf, 0, size);
+#ifdef HAVE_UNINAMESLIST_NAMESLISTVERSION
+  const char *version = uniNamesList_NamesListVersion();
+  if(version != NULL) {
+    strncpy(buf, version, size - 1);
+  }
+#endif
+}
+
+int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/** Appends a (trigram, code point) pair for every trigram of str.
+ *
+ * \return Zero on success, negative if out of memory.
+ */
+int add_trigrams(uint64_t **pairs, size_t *n, size_t *cap, const char *str, uint32_t cp)
+{
+  size_t len = strlen(str);
+  for(size_t i = 0; i + 3 <= len; i++) {
+    if(*n == *cap) {
+      size_t newcap = *cap ? 2 * *cap : 1 << 16;
+      uint64_t *p = (uint64_t *)realloc(*pairs, newcap * sizeof(uint64_t));
+      if(p == NULL)
+        return -1;
+      *pairs = p;
+      *cap = newcap;
+    }
+    uint32_t key = ((uint32_t)name_fold(str[i]) << 16) | ((uint32_t)name_fold(str[i + 1]) << 8) |
+                   name_fold(str[i + 2]);
+    (*pairs)[(*n)++] = ((uint64_t)key << 32) | cp;
+  }
+  return 0;
+}
+
+/** Writes the trigram index of every Unicode name and annotation
+ *  to the cache.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int build_names()
+{
+  char path[4096];
+  if(index_path(path, sizeof(path), "names", 1) < 0) {
+    return -1;
+  }
+
+  uint64_t *pairs = NULL;
+  size_t npairs = 0, paircap = 0;
+  for(uint32_t cp = 0; cp <= 0x10FFFF; cp++) {
+    struct unicode_nameannot info = lookup_info(cp);
+    if(((info.name != NULL) && (add_trigrams(&pairs, &npairs, &paircap, info.name, cp) < 0)) ||
+       ((info.annot != NULL) && (add_trigrams(&pairs, &npairs, &paircap, info.annot, cp) < 0))) {
+      free(pairs);
+      return -1;
+    }
+  }
+
+  // Sorting by trigram, then code point, leaves each posting list
+  // in order; duplicates from repeated trigrams are dropped.
+  qsort(pairs, npairs, sizeof(uint64_t), compare_u64);
+  uint32_t ntrigrams = 0, nposts = 0;
+  for(size_t i = 0; i < npairs; i++) {
+    if((i > 0) && (pairs[i] == pairs[i - 1]))
+      continue;
+    if((i == 0) || ((pairs[i] >> 32) != (pairs[i - 1] >> 32)))
+      ntrigrams++;
+    nposts++;
+  }
+
+  struct names_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, NAMES_MAGIC, sizeof(hdr.magic));
+  hdr.version = NAMES_VERSION;
+  names_version(hdr.libversion, sizeof(hdr.libversion));
+  hdr.ntrigrams = ntrigrams;
+  hdr.nposts = nposts;
+  hdr.trigrams_off = ALIGN8(sizeof(hdr));
+  hdr.posts_off = ALIGN8(hdr.trigrams_off + ntrigrams * sizeof(struct names_trigram));
+  size_t total = ALIGN8((size_t)hdr.posts_off + nposts * sizeof(uint32_t));
+  hdr.size = (uint32_t)total;
+
+  int ret = -1;
+  char *buf = (char *)calloc(1, total);
+  if(buf != NULL) {
+    memcpy(buf, &hdr, sizeof(hdr));
+    struct names_trigram *tri = (struct names_trigram *)(buf + hdr.trigrams_off) - 1;
+    uint32_t *posts = (uint32_t *)(buf + hdr.posts_off);
+    uint32_t p = 0;
+    for(size_t i = 0; i < npairs; i++) {
+      if((i > 0) && (pairs[i] == pairs[i - 1]))
+        continue;
+      if((i == 0) || ((pairs[i] >> 32) != (pairs[i - 1] >> 32))) {
+        tri++;
+        tri->key = (uint32_t)(pairs[i] >> 32);
+        tri->first = p;
+      }
+      tri->count++;
+      posts[p++] = (uint32_t)pairs[i];
+    }
+
+    if(replace_file(path, buf, total) == 0) {
+      DBG("Wrote name index %s: %u trigrams, %u postings\n", path, ntrigrams, nposts);
+      ret = 0;
+    }
+    free(buf);
+  }
+  free(pairs);
+
+  return ret;
+}
+
+/** Unmaps the name index.
+ */
+void close_names()
+{
+  if(global.names != NULL) {
+    munmap((void *)global.names, global.namessize);
+    global.names = NULL;
+  }
+}
+
+/** Maps the cached name index if it matches the names library.
+ *
+ * \return Zero on success, negative if missing or stale.
+ */
+int open_names()
+{
+  char path[4096];
+  if(index_path(path, sizeof(path), "names", 0) < 0) {
+    return -1;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return -1;
+  }
+
+  struct stat sbuf;
+  if((fstat(fd, &sbuf) < 0) || (sbuf.st_size < (off_t)sizeof(struct names_header))) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    return -1;
+  }
+
+  const struct names_header *hdr = (const struct names_header *)map;
+  char version[sizeof(hdr->libversion)];
+  names_version(version, sizeof(version));
+  if((memcmp(hdr->magic, NAMES_MAGIC, sizeof(hdr->magic)) != 0) ||
+     (hdr->version != NAMES_VERSION) || (hdr->size != (uint64_t)sbuf.st_size) ||
+     (memcmp(hdr->libversion, version, sizeof(version)) != 0) ||
+     ((uint64_t)hdr->trigrams_off + hdr->ntrigrams * sizeof(struct names_trigram) > hdr->posts_off) ||
+     ((uint64_t)hdr->posts_off + hdr->nposts * sizeof(uint32_t) > hdr->size)) {
+    DBG("Name index %s is invalid or stale\n", path);
+    munmap(map, sbuf.st_size);
+    return -1;
+  }
+
+  global.names = hdr;
+  global.namessize = sbuf.st_size;
+  return 0;
+}
+
+/** Finds the code points listed for a trigram in the name index.
+ *
+ * \return Number of code points, zero if the trigram never occurs.
+ */
+uint32_t names_postings(uint32_t key, const uint32_t **posts)
+{
+  const char *base = (const char *)global.names;
+  const struct names_trigram *tri = (const struct names_trigram *)(base + global.names->trigrams_off);
+  uint32_t lo = 0, hi = global.names->ntrigrams;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(tri[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if((lo == global.names->ntrigrams) || (tri[lo].key != key) ||
+     ((uint64_t)tri[lo].first + tri[lo].count > global.names->nposts)) {
+    return 0;
+  }
+  *posts = (const uint32_t *)(base + global.names->posts_off) + tri[lo].first;
+  return tri[lo].count;
+}
+
+/** Checks for an upper cased needle in str, ignoring ASCII case.
+ */
+int name_contains(const char *str, const char *needle, size_t len)
+{
+  if(str == NULL)
+    return 0;
+  for(; *str != '\0'; str++) {
+    size_t i = 0;
+    while((i < len) && (str[i] != '\0') && (name_fold(str[i]) == (unsigned char)needle[i]))
+      i++;
+    if(i == len)
+      return 1;
+  }
+  return 0;
+}
+
+/** Checks whether a code point's name or annotation contains needle.
+ */
+int name_matches(uint32_t cp, const char *needle, size_t len)
+{
+  struct unicode_nameannot info = lookup_info(cp);
+  return name_contains(info.name, needle, len) || name_contains(info.annot, needle, len);
+}
+
+/** Requests every code point whose Unicode name or annotation
+ *  contains query, ignoring ASCII case.
+ *
+ * Candidates are the code points listed under all of the query's
+ * trigrams, which are then checked against the names themselves.
+ * Queries shorter than a trigram, or without a usable index,
+ * check every name.
+ *
+ * \return Number of code points found, negative on error.
+ */
+long search_names(const char *query)
+{
+  size_t len = strlen(query);
+  char *needle = (char *)malloc(len + 1);
+  if(needle == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  for(size_t i = 0; i <= len; i++) {
+    needle[i] = (char)name_fold(query[i]);
+  }
+
+  if((len >= 3) && (args.reindex || (open_names() < 0))) {
+    if((build_names() < 0) || (open_names() < 0)) {
+      DBG("Name index unavailable, checking every name.\n");
+    }
+  }
+
+  int before = global.nranges;
+  long found = 0;
+  int ret = 0;
+  if((len >= 3) && (global.names != NULL)) {
+    // Walk the shortest posting list, probing the others.
+    size_t ntri = len - 2;
+    const uint32_t **lists = (const uint32_t **)malloc(ntri * sizeof(*lists));
+    uint32_t *counts = (uint32_t *)malloc(ntri * sizeof(*counts));
+    uint32_t *pos = (uint32_t *)calloc(ntri, sizeof(*pos));
+    if((lists == NULL) || (counts == NULL) || (pos == NULL)) {
+      fprintf(stderr, "Out of memory.\n");
+      ret = -1;
+      ntri = 0;
+    }
+
+    size_t shortest = 0;
+    for(size_t t = 0; t < ntri; t++) {
+      uint32_t key = ((uint32_t)(unsigned char)needle[t] << 16) |
+                     ((uint32_t)(unsigned char)needle[t + 1] << 8) | (unsigned char)needle[t + 2];
+      counts[t] = names_postings(key, &lists[t]);
+      if(counts[t] < counts[shortest])
+        shortest = t;
+    }
+    for(uint32_t i = 0; (ntri > 0) && (ret == 0) && (i < counts[shortest]); i++) {
+      uint32_t cp = lists[shortest][i];
+      size_t t;
+      for(t = 0; t < ntri; t++) {
+        // Lists are sorted, so each one is only walked forward.
+        while((pos[t] < counts[t]) && (lists[t][pos[t]] < cp))
+          pos[t]++;
+        if((pos[t] == counts[t]) || (lists[t][pos[t]] != cp))
+          break;
+      }
+      if((t == ntri) && name_matches(cp, needle, len)) {
+        ret = add_range(cp, cp);
+        found++;
+      }
+    }
+    free(pos);
+    free(counts);
+    free(lists);
+  } else {
+    for(uint32_t cp = 0; (ret == 0) && (cp <= 0x10FFFF); cp++) {
+      if(name_matches(cp, needle, len)) {
+        ret = add_range(cp, cp);
+        found++;
+      }
+    }
+  }
+  free(needle);
+  close_names();
+
+  if((before == 0) && (found > 0)) {
+    global.character = global.ranges[0].first;
+    format_codepoint(global.hexchar, sizeof(global.hexchar), global.character);
+  }
+
+  return ret < 0 ? -1 : found;
+}
+
+/** Calls fn for every charset page of every candidate font,
+ *  from the index when it's open or from fontconfig otherwise.
+ *
+ * \param fn Called with ctx, the font number, the first code
+ *           point of the page and the page's 256 bit leaf.
+ */
+void walk_font_pages(void (*fn)(void *, int, uint32_t, const FcChar32 *), void *ctx)
+{
+  if(global.index) {
+    const char *base = (const char *)global.index;
+    const struct index_page *pages = (const struct index_page *)(base + global.index->pages_off);
+    const struct index_posting *posts = (const struct index_posting *)(base + global.index->posts_off);
+    uint64_t maxposts = (global.index->strings_off - global.index->posts_off) / sizeof(*posts);
+    for(uint32_t p = 0; p < global.index->npages; p++) {
+      if((uint64_t)pages[p].first + pages[p].count > maxposts)
+        continue;
+      const struct index_posting *post = &posts[pages[p].first];
+      for(uint32_t i = 0; i < pages[p].count; i++, post++) {
+        const struct index_font *f = (const struct index_font *)(base + global.index->fonts_off) + post->font;
+        if((post->font < global.index->nfonts) && (args.fixed || (f->flags & INDEX_SCALABLE)))
+          fn(ctx, post->font, pages[p].page << 8, post->leaf);
+      }
+    }
+    return;
+  }
+
+  for(int f = 0; f < global.allfs->nfont; f++) {
+    if(global.charsets[f] == NULL)
+      continue;
+    FcChar32 map[FC_CHARSET_MAP_SIZE];
+    FcChar32 next;
+    for(FcChar32 page = FcCharSetFirstPage(global.charsets[f], map, &next);
+        page != FC_CHARSET_DONE;
+        page = FcCharSetNextPage(global.charsets[f], map, &next)) {
+      fn(ctx, f, page, map);
+    }
+  }
+}
+
+/** ORs a charset page into a bitmap of all code points.
+ */
+void union_add_page(void *ctx, int font, uint32_t base, const FcChar32 *leaf)
+{
+  if(base > 0x10FFFF) {
+    return;
+  }
+
+  uint64_t *any = (uint64_t *)ctx + (base >> 6);
+  for(int w = 0; w < 4; w++) {
+    uint64_t bits;
+    memcpy(&bits, leaf + 2 * w, sizeof(bits));
+    any[w] |= bits;
+  }
+}
+
+/** Builds a bitmap of the code points any candidate font covers.
+ *
+ * \return The bitmap, 0x110000 bits long, or NULL if out of memory.
+ */
+uint64_t *build_union()
+{
+  uint64_t *any = (uint64_t *)calloc(0x110000 / 64, sizeof(uint64_t));
+  if(any != NULL) {
+    walk_font_pages(union_add_page, any);
+  }
+  return any;
+}
+
+/** Checks a code point in a bitmap from build_union().
+ */
+int union_has(const uint64_t *any, uint32_t cp)
+{
+  return (cp <= 0x10FFFF) && (any[cp >> 6] & ((uint64_t)1 << (cp & 63)));
+}
+
+// Code points per font and Unicode block, for --coverage and --sort.
+struct coverage {
+  int nblocks;
+  uint32_t *first;     // Block ranges, sorted
+  uint32_t *last;
+  int nfonts;
+  uint32_t *counts;    // nfonts x nblocks code points covered
+  uint64_t *any;       // Bitmap of code points covered by any font
+};
+
+/** Counts the bits of a charset leaf from bit lo to bit hi inclusive.
+ */
+unsigned int leaf_popcount(const FcChar32 *leaf, unsigned int lo, unsigned int hi)
+{
+  unsigned int count = 0;
+
+  if((lo == 0) && (hi == 255)) {
+    // Whole leaf, a 64 bit word at a time.
+    uint64_t words[4];
+    memcpy(words, leaf, sizeof(words));
+    return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]) +
+           __builtin_popcountll(words[2]) + __builtin_popcountll(words[3]);
+  }
+
+  for(unsigned int w = lo >> 5; w <= (hi >> 5); w++) {
+    FcChar32 bits = leaf[w];
+    if(w == (lo >> 5))
+      bits &= ~(FcChar32)0 << (lo & 31);
+    if(w == (hi >> 5) && ((hi & 31) != 31))
+      bits &= ((FcChar32)1 << ((hi & 31) + 1)) - 1;
+    count += __builtin_popcount(bits);
+  }
+  return count;
+}
+
+/** Adds one 256 code point charset page of a font to the counts.
+ *
+ * \param base First code point of the page.
+ * \param leaf Bitmap of the page's code points.
+ */
+void coverage_add_page(void *ctx, int font, uint32_t base, const FcChar32 *leaf)
+{
+  struct coverage *cov = (struct coverage *)ctx;
+  if(base > 0x10FFFF) {
+    return;
+  }
+  union_add_page(cov->any, font, base, leaf);
+
+  // First block ending at or after the page.
+  int lo = 0, hi = cov->nblocks;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(cov->last[mid] < base)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  uint32_t *row = cov->counts + (size_t)font * cov->nblocks;
+  for(int b = lo; (b < cov->nblocks) && (cov->first[b] <= base + 255); b++) {
+    uint32_t from = cov->first[b] > base ? cov->first[b] - base : 0;
+    uint32_t to = cov->last[b] < base + 255 ? cov->last[b] - base : 255;
+    row[b] += leaf_popcount(leaf, from, to);
+  }
+}
+
+/** Makes room for a result for every font.
+ */
+int reserve_results()
+{
+  int max = global.index ? (int)global.index->nfonts : global.allfs->nfont;
+  if(max > global.resultcap) {
+    struct fontinfo *r = (struct fontinfo *)realloc(global.results, max * sizeof(*r));
+    if(r == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    global.results = r;
+    global.resultcap = max;
+  }
+  return max;
+}
+
+/** Hashes the key results are grouped on.
+ */
+uint32_t group_hash(const struct fontinfo *fi)
+{
+  const char *key = (args.group == GROUP_FILE) ? fi->file : fi->family;
+  uint32_t h = 2166136261u;
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h;
+}
+
+/** Checks if two results belong to the same group.
+ */
+int group_match(const struct fontinfo *a, const struct fontinfo *b)
+{
+  if(args.group == GROUP_FILE)
+    return strcmp(a->file, b->file) == 0;
+  return strcmp(a->family, b->family) == 0;
+}
+
+/** Collapses the first n entries of global.results by family,
+ *  or by file with --group=file, keeping the first entry of
+ *  each group in place.
+ *
+ * The style of each remaining entry becomes the comma separated
+ * styles of its group, stored in global.styles.
+ *
+ * \return Number of entries left.
+ */
+int group_results(int n)
+{
+  if((args.group == GROUP_NONE) || (n <= 1)) {
+    return n;
+  }
+
+  // Open addressed table of group heads, at most half full.
+  int size = 16;
+  while(size < 2 * n)
+    size *= 2;
+  if(size > global.groupsize) {
+    int *slots = (int *)realloc(global.groupslots, size * sizeof(int));
+    if(slots == NULL) {
+      return n;
+    }
+    global.groupslots = slots;
+    global.groupsize = size;
+  }
+  if(n > global.groupcap) {
+    int *next = (int *)realloc(global.groupnext, n * sizeof(int));
+    int *tail = (int *)realloc(global.grouptail, n * sizeof(int));
+    if(next != NULL)
+      global.groupnext = next;
+    if(tail != NULL)
+      global.grouptail = tail;
+    if((next == NULL) || (tail == NULL)) {
+      return n;
+    }
+    global.groupcap = n;
+  }
+  int *slots = global.groupslots;
+  int *next = global.groupnext;
+  int *tail = global.grouptail;
+  memset(slots, -1, size * sizeof(int));
+
+  // Chain every entry onto the first entry with the same key.
+  struct fontinfo *res = global.results;
+  int heads = 0;
+  for(int i = 0; i < n; i++) {
+    next[i] = -1;
+    uint32_t h = group_hash(&res[i]) & (size - 1);
+    while((slots[h] >= 0) && !group_match(&res[slots[h]], &res[i]))
+      h = (h + 1) & (size - 1);
+    if(slots[h] < 0) {
+      slots[h] = i;
+      tail[i] = i;
+      heads++;
+    } else {
+      next[tail[slots[h]]] = i;
+      tail[slots[h]] = i;
+    }
+  }
+  if(heads == n) {
+    return n;
+  }
+
+  // Join the styles of each group, skipping repeats.
+  global.styles.len = 0;
+  int *offsets = tail;
+  for(int i = 0; i < n; i++) {
+    offsets[i] = -1;
+  }
+  for(int s = 0; s < size; s++) {
+    int head = slots[s];
+    if(head < 0)
+      continue;
+
+    size_t start = global.styles.len;
+    for(int i = head; i >= 0; i = next[i]) {
+      int repeat = 0;
+      for(int j = head; j != i; j = next[j]) {
+        if(strcmp(res[j].style, res[i].style) == 0) {
+          repeat = 1;
+          break;
+        }
+      }
+      if(repeat)
+        continue;
+      if(global.styles.len > start) {
+        global.styles.data[global.styles.len - 1] = ',';
+      }
+      if(strbuf_add(&global.styles, res[i].style) < 0) {
+        return n;
+      }
+    }
+    offsets[head] = (int)start;
+  }
+
+  // Keep the heads in their original order.
+  int kept = 0;
+  for(int i = 0; i < n; i++) {
+    if(offsets[i] < 0)
+      continue;
+    res[kept] = res[i];
+    res[kept].style = global.styles.data + offsets[i];
+    kept++;
+  }
+
+  return kept;
+}
+
+/** Merges the slices' results for the k-th scanned code point
+ *  into global.results, in candidate font order.
+ *
+ * \return Number of fonts found.
+ */
+int gather_fonts(int k)
+{
+  int found = 0;
+  for(int t = 0; t < pool.nslices; t++) {
+    struct scan_slice *sl = &pool.slices[t];
+    const unsigned char *row = sl->hits + k;
+    for(int f = sl->first; f < sl->last; f++, row += SCANBLOCK) {
+      if(*row) {
+        get_fontinfo(f, &global.results[found++]);
+      }
+    }
+  }
+  return found;
+}
+
+/** Sorts the fonts by how well fontconfig thinks they match a
+ *  pattern such as "monospace" or "DejaVu Sans:bold".
+ *
+ * \param trim Drop fonts that add no coverage to those before them.
+ * \return The sorted fonts, NULL if the name is invalid or matches none.
+ */
+FcFontSet *sort_fonts(const char *name, FcBool trim)
+{
+  init_fontconfig();
+  FcPattern *pat = FcNameParse((const FcChar8 *)name);
+  if(pat == NULL) {
+    fprintf(stderr, "Invalid font name '%s'.\n", name);
+    return NULL;
+  }
+  FcConfigSubstitute(NULL, pat, FcMatchPattern);
+  FcDefaultSubstitute(pat);
+
+  FcResult result;
+  FcFontSet *fs = FcFontSort(NULL, pat, trim, NULL, &result);
+  FcPatternDestroy(pat);
+  if((fs != NULL) && (fs->nfont == 0)) {
+    FcFontSetDestroy(fs);
+    fs = NULL;
+  }
+  if(fs == NULL) {
+    fprintf(stderr, "No fonts match '%s'.\n", name);
+  }
+  return fs;
+}
+
+/** Hashes a font file and face index.
+ */
+uint32_t face_hash(const char *file, int index)
+{
+  uint32_t h = 2166136261u;
+  for(const char *p = file; *p != '\0'; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  return (h ^ (uint32_t)index) * 16777619u;
+}
+
+/** Finds where each candidate font comes in fontconfig's sort for
+ *  the --fallback family, or the default family without one.
+ *
+ * \return Position of every font, INT_MAX for those not sorted,
+ *         or NULL on error.
+ */
+int *match_ranks(int nfonts)
+{
+  FcFontSet *sorted = sort_fonts(args.fallback ? args.fallback : "", FcFalse);
+  int *ranks = (int *)malloc((nfonts + 1) * sizeof(int));
+  int size = 16;
+  while(sorted && (size < 2 * sorted->nfont))
+    size *= 2;
+  int *slots = (int *)malloc(size * sizeof(int));
+  if((sorted == NULL) || (ranks == NULL) || (slots == NULL)) {
+    if(sorted != NULL)
+      FcFontSetDestroy(sorted);
+    free(ranks);
+    free(slots);
+    return NULL;
+  }
+
+  // Open addressed table of sorted fonts by file and face.
+  memset(slots, -1, size * sizeof(int));
+  for(int i = 0; i < sorted->nfont; i++) {
+    struct fontinfo fi;
+    pattern_fontinfo(sorted->fonts[i], i, &fi);
+    uint32_t h = face_hash(fi.file, fi.index) & (size - 1);
+    while(slots[h] >= 0)
+      h = (h + 1) & (size - 1);
+    slots[h] = i;
+  }
+
+  for(int f = 0; f < nfonts; f++) {
+    struct fontinfo fi;
+    ranks[f] = INT_MAX;
+    if(global.index) {
+      if(index_fontinfo(f, &fi) < 0)
+        continue;
+    } else {
+      get_fontinfo(f, &fi);
+    }
+    uint32_t h = face_hash(fi.file, fi.index) & (size - 1);
+    for(; slots[h] >= 0; h = (h + 1) & (size - 1)) {
+      struct fontinfo si;
+      pattern_fontinfo(sorted->fonts[slots[h]], slots[h], &si);
+      if((si.index == fi.index) && (strcmp(si.file, fi.file) == 0)) {
+        ranks[f] = slots[h];
+        break;
+      }
+    }
+  }
+
+  free(slots);
+  FcFontSetDestroy(sorted);
+  return ranks;
+}
+
+/** Computes what --sort ranks fonts by, once for all fonts.
+ *
+ * \return Zero on success, negative on error.
+ */
+int prepare_ranks()
+{
+  if(global.rankready) {
+    return global.rankready > 0 ? 0 : -1;
+  }
+  global.rankready = -1;
+  int nfonts = global.index ? (int)global.index->nfonts : global.allfs->nfont;
+
+  if(args.sort == SORT_MATCH) {
+    global.rankmatch = match_ranks(nfonts);
+    if(global.rankmatch == NULL)
+      return -1;
+  } else if(args.sort == SORT_COVERAGE) {
+    // Code points per block, or in all of Unicode without block data.
+    struct coverage *cov = (struct coverage *)calloc(1, sizeof(*cov));
+    if(cov == NULL)
+      return -1;
+    global.rankcov = cov;
+    cov->nblocks = 1;
+#ifdef HAVE_UNINAMESLIST_BLOCKCOUNT
+    if(uniNamesList_blockCount() > 0)
+      cov->nblocks = uniNamesList_blockCount();
+#endif
+    cov->nfonts = nfonts;
+    cov->first = (uint32_t *)malloc(cov->nblocks * sizeof(uint32_t));
+    cov->last = (uint32_t *)malloc(cov->nblocks * sizeof(uint32_t));
+    cov->counts = (uint32_t *)calloc((size_t)(nfonts + 1) * cov->nblocks, sizeof(uint32_t));
+    cov->any = (uint64_t *)calloc(0x110000 / 64, sizeof(uint64_t));
+    global.ranktotal = (uint32_t *)calloc(nfonts + 1, sizeof(uint32_t));
+    if((cov->first == NULL) || (cov->last == NULL) || (cov->counts == NULL) ||
+       (cov->any == NULL) || (global.ranktotal == NULL)) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    cov->first[0] = 0;
+    cov->last[0] = 0x10FFFF;
+#ifdef HAVE_UNINAMESLIST_BLOCKCOUNT
+    for(int b = 0; (cov->nblocks > 1) && (b < cov->nblocks); b++) {
+      cov->first[b] = (uint32_t)uniNamesList_blockStart(b);
+      cov->last[b] = (uint32_t)uniNamesList_blockEnd(b);
+    }
+#endif
+    walk_font_pages(coverage_add_page, cov);
+    for(int f = 0; f < nfonts; f++) {
+      const uint32_t *row = cov->counts + (size_t)f * cov->nblocks;
+      for(int b = 0; b < cov->nblocks; b++) {
+        global.ranktotal[f] += row[b];
+      }
+    }
+  }
+
+  global.rankready = 1;
+  return 0;
+}
+
+/** Frees what --sort ranks fonts by, as when the fonts change.
+ */
+void free_ranks()
+{
+  if(global.rankcov != NULL) {
+    free(global.rankcov->first);
+    free(global.rankcov->last);
+    free(global.rankcov->counts);
+    free(global.rankcov->any);
+    free(global.rankcov);
+    global.rankcov = NULL;
+  }
+  free(global.ranktotal);
+  free(global.rankmatch);
+  global.ranktotal = NULL;
+  global.rankmatch = NULL;
+  global.rankready = 0;
+}
+
+/** Finds the block containing a code point in the --sort counts.
+ *
+ * \return The block, negative if none contains it.
+ */
+int rank_block(uint32_t cp)
+{
+  const struct coverage *cov = global.rankcov;
+  int lo = 0, hi = cov->nblocks;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(cov->last[mid] < cp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ((lo < cov->nblocks) && (cov->first[lo] <= cp)) ? lo : -1;
+}
+
+/** Checks if result a ranks ahead of result b under --sort.
+ *  Ties keep the order fonts were found in.
+ */
+int rank_before(int a, int b, int block)
+{
+  const struct fontinfo *fa = &global.results[a], *fb = &global.results[b];
+  long diff = 0;
+
+  switch(args.sort) {
+  case SORT_COVERAGE:
+    if(block >= 0) {
+      const struct coverage *cov = global.rankcov;
+      diff = (long)cov->counts[(size_t)fb->id * cov->nblocks + block] -
+             (long)cov->counts[(size_t)fa->id * cov->nblocks + block];
+    }
+    if(diff == 0)
+      diff = (long)global.ranktotal[fb->id] - (long)global.ranktotal[fa->id];
+    break;
+  case SORT_MATCH:
+    diff = (long)global.rankmatch[fa->id] - (long)global.rankmatch[fb->id];
+    break;
+  case SORT_NAME:
+    diff = strcasecmp(fa->family, fb->family);
+    if(diff == 0)
+      diff = strcasecmp(fa->style, fb->style);
+    break;
+  }
+
+  return (diff != 0) ? (diff < 0) : (a < b);
+}
+
+/** Moves the best fonts found for cp to the front of
+ *  global.results in --sort order.
+ *
+ * Only --maxfonts fonts are wanted, so they are picked with a
+ * bounded heap whose root is the worst kept, rather than sorting
+ * every font found.
+ *
+ * \return Number of fonts kept.
+ */
+int rank_results(uint32_t cp, int n)
+{
+  if((args.sort == SORT_NONE) || (n <= 1) || (prepare_ranks() < 0)) {
+    return n;
+  }
+  int k = ((args.maxfonts > 0) && (args.maxfonts < n)) ? args.maxfonts : n;
+  int block = (args.sort == SORT_COVERAGE) ? rank_block(cp) : -1;
+
+  int *heap = (int *)malloc(k * sizeof(int));
+  struct fontinfo *kept = (struct fontinfo *)malloc(k * sizeof(struct fontinfo));
+  if((heap == NULL) || (kept == NULL)) {
+    free(heap);
+    free(kept);
+    return n;
+  }
+
+  int size = 0;
+  for(int i = 0; i < n; i++) {
+    int pos;
+    if(size < k) {
+      // Sift up from the new leaf.
+      pos = size++;
+      while((pos > 0) && rank_before(heap[(pos - 1) / 2], i, block)) {
+        heap[pos] = heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+      }
+      heap[pos] = i;
+      continue;
+    }
+    if(!rank_before(i, heap[0], block))
+      continue;
+
+    // Replace the worst kept font and sift down.
+    pos = 0;
+    while(1) {
+      int child = 2 * pos + 1;
+      if(child >= size)
+        break;
+      if((child + 1 < size) && rank_before(heap[child], heap[child + 1], block))
+        child++;
+      if(!rank_before(i, heap[child], block))
+        break;
+      heap[pos] = heap[child];
+      pos = child;
+    }
+    heap[pos] = i;
+  }
+
+  // Popping the worst each time fills the output from the back.
+  while(size > 0) {
+    int worst = heap[0];
+    int last = heap[--size];
+    int pos = 0;
+    while(1) {
+      int child = 2 * pos + 1;
+      if(child >= size)
+        break;
+      if((child + 1 < size) && rank_before(heap[child], heap[child + 1], block))
+        child++;
+      if(!rank_before(last, heap[child], block))
+        break;
+      heap[pos] = heap[child];
+      pos = child;
+    }
+    if(size > 0)
+      heap[pos] = last;
+    kept[size] = global.results[worst];
+  }
+
+  memcpy(global.results, kept, k * sizeof(struct fontinfo));
+  free(kept);
+  free(heap);
+  return k;
+}
+
+/** Finds the fonts containing a character, from the
+ *  reverse index when open or the candidate fonts otherwise.
+ *
+ * \return Number of fonts found, stored in global.results.
+ */
+int collect_fonts(uint32_t character)
+{
+  int max = reserve_results();
+  if(max < 0) {
+    return 0;
+  }
+
+  if(global.index) {
+    return rank_results(character, group_results(index_collect_fonts(character, global.results, max)));
+  }
+
+  scan_codepoints(&character, 1);
+  return rank_results(character, group_results(gather_fonts(0)));
+}
+
+/** Writes a string as a JSON string literal.
+ */
+void write_json_string(FILE *out, const char *str)
+{
+  putc('"', out);
+  for(const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    if((*p == '"') || (*p == '\\')) {
+      putc('\\', out);
+      putc(*p, out);
+    } else if(*p < 0x20) {
+      fprintf(out, "\\u%04x", *p);
+    } else {
+      putc(*p, out);
+    }
+  }
+  putc('"', out);
+}
+
+/** Writes a TSV field, escaping backslashes, tabs and line breaks.
+ */
+void write_tsv_field(FILE *out, const char *str)
+{
+  for(const char *p = str; *p; p++) {
+    switch(*p) {
+    case '\\': fputs("\\\\", out); break;
+    case '\t': fputs("\\t", out); break;
+    case '\n': fputs("\\n", out); break;
+    case '\r': fputs("\\r", out); break;
+    default: putc(*p, out); break;
+    }
+  }
+}
+
+/** Writes one font found for a code point as a --format record.
+ *
+ * \param fallback Set for the font fontconfig would fall back to.
+ *                 With --fallback, TSV and NUL records carry it
+ *                 as a column after the face index.
+ */
+void print_record(uint32_t cp, const char *name, const struct fontinfo *fi, int fallback)
+{
+  char hexchar[11];
+  format_codepoint(hexchar, sizeof(hexchar), cp);
+
+  switch(args.format) {
+  case FORMAT_JSONL:
+    fprintf(stdout, "{\"codepoint\":\"%s\",\"family\":", hexchar);
+    write_json_string(stdout, fi->family);
+    fputs(",\"style\":", stdout);
+    write_json_string(stdout, fi->style);
+    fputs(",\"file\":", stdout);
+    write_json_string(stdout, fi->file);
+    fprintf(stdout, ",\"index\":%d", fi->index);
+    if(fallback) {
+      fputs(",\"fallback\":true", stdout);
+    }
+    if(name != NULL) {
+      fputs(",\"name\":", stdout);
+      write_json_string(stdout, name);
+    }
+    fputs("}\n", stdout);
+    break;
+
+  case FORMAT_TSV:
+    fputs(hexchar, stdout);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->family);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->style);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->file);
+    fprintf(stdout, "\t%d", fi->index);
+    if(args.fallback != NULL) {
+      fprintf(stdout, "\t%d", fallback);
+    }
+    if(name != NULL) {
+      putc('\t', stdout);
+      write_tsv_field(stdout, name);
+    }
+    putc('\n', stdout);
+    break;
+
+  case FORMAT_NUL:
+    fputs(hexchar, stdout);
+    putc('\0', stdout);
+    fputs(fi->family, stdout);
+    putc('\0', stdout);
+    fputs(fi->style, stdout);
+    putc('\0', stdout);
+    fputs(fi->file, stdout);
+    putc('\0', stdout);
+    fprintf(stdout, "%d", fi->index);
+    putc('\0', stdout);
+    if(args.fallback != NULL) {
+      fprintf(stdout, "%d", fallback);
+      putc('\0', stdout);
+    }
+    if(name != NULL) {
+      fputs(name, stdout);
+      putc('\0', stdout);
+    }
+    break;
+  }
+}
+
+/** Prints the first n fonts in global.results, found for cp.
+ *
+ * Plain output lists families, with their styles when grouped;
+ * --format output has one record per font.
+ */
+void print_results(uint32_t cp, int n, const char *prefix)
+{
+  if((args.maxfonts > 0) && (args.maxfonts < n))
+    n = args.maxfonts;
+
+  if(args.format != FORMAT_TEXT) {
+    const char *name = NULL;
+    if(args.showname) {
+      name = lookup_info(cp).name;
+      if(name == NULL)
+        name = "";
+    }
+    for(int i = 0; i < n; i++) {
+      print_record(cp, name, &global.results[i], 0);
+    }
+    return;
+  }
+
+  for(int i = 0; i < n; i++) {
+    if(args.group == GROUP_NONE) {
+      printf("%s%s\n", prefix, global.results[i].family);
+    } else {
+      printf("%s%s:style=%s\n", prefix, global.results[i].family, global.results[i].style);
+    }
+  }
+}
+
+/** Writes the events in the --trace ring buffer as a Chrome
+ *  trace, which chrome://tracing and Perfetto can open.
+ */
+int write_trace()
+{
+  if(global.trace == NULL) {
+    return 0;
+  }
+
+  FILE *fp = fopen(args.trace, "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", args.trace, strerror(errno));
+    return -1;
+  }
+
+  unsigned long count = global.tracenext;
+  unsigned long first = count > TRACECAP ? count - TRACECAP : 0;
+  if(first > 0) {
+    DBG("Trace buffer overflowed, %lu events lost\n", first);
+  }
+
+  fputs("{\"traceEvents\":[\n", fp);
+  for(unsigned long n = first; n < count; n++) {
+    const struct trace_event *e = &global.trace[n % TRACECAP];
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f", n > first ? ",\n" : "", e->name, e->tid,
+            (e->ts - global.statstart) * 1e3, e->dur * 1e3);
+    if(e->arg[0] != '\0') {
+      fputs(",\"args\":{\"detail\":", fp);
+      write_json_string(fp, e->arg);
+      putc('}', fp);
+    }
+    putc('}', fp);
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+
+  free(global.trace);
+  global.trace = NULL;
+
+  if(fclose(fp) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", args.trace, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/** Sorts the fonts in the order fontconfig would fall back through
+ *  them for a family name, keeping the set and its charsets.
+ *
+ * \return Zero on success, negative on error.
+ */
+int sort_fallback(const char *family)
+{
+  // Trimmed like Xft and Pango do: fonts adding no coverage are dropped.
+  global.fallback = sort_fonts(family, FcTrue);
+  if(global.fallback == NULL) {
+    return -1;
+  }
+
+  global.fallbackcs = (FcCharSet **)malloc(global.fallback->nfont * sizeof(FcCharSet *));
+  if(global.fallbackcs == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  for(int i = 0; i < global.fallback->nfont; i++) {
+    if(FcPatternGetCharSet(global.fallback->fonts[i], FC_CHARSET, 0,
+                           &global.fallbackcs[i]) != FcResultMatch) {
+      global.fallbackcs[i] = NULL;
+    }
+  }
+
+  DBG("%d fonts in fallback order for %s\n", global.fallback->nfont, family);
+  return 0;
+}
+
+/** Prints the first font in fallback order containing a character.
+ */
+void print_fallback(uint32_t cp, const char *prefix)
+{
+  int i;
+  for(i = 0; i < global.fallback->nfont; i++) {
+    if((global.fallbackcs[i] != NULL) && FcCharSetHasChar(global.fallbackcs[i], cp))
+      break;
+  }
+
+  if(args.format != FORMAT_TEXT) {
+    if(i < global.fallback->nfont) {
+      struct fontinfo fi;
+      pattern_fontinfo(global.fallback->fonts[i], i, &fi);
+      print_record(cp, NULL, &fi, 1);
+    }
+    return;
+  }
+
+  if(i < global.fallback->nfont) {
+    struct fontinfo fi;
+    pattern_fontinfo(global.fallback->fonts[i], i, &fi);
+    printf("%sFallback: %s:style=%s\n", prefix, fi.family, fi.style);
+  } else {
+    printf("%sFallback: none\n", prefix);
+  }
+}
+
+/** Prints the families of fonts containing a character.
+ */
+void print_fonts(uint32_t character, const char *prefix)
+{
+  print_results(character, collect_fonts(character), prefix);
+}
+
+/** Searches the candidate fonts for the desired
+ *  character and stores the font set found.
+ *
+ * For a matrix the set holds every font found for any of its
+ * characters, in the order they're first found.
+ */
+int generate_fontset()
+{
+    global.info = lookup_info(global.character);
+
+    global.fs = FcFontSetCreate();
+
+    unsigned char *added = NULL;
+    if(global.nmatrix > 1) {
+      added = (unsigned char *)calloc(global.allfs->nfont + 1, 1);
+      if(added == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+      }
+    }
+
+    int nchars = global.nmatrix > 1 ? global.nmatrix : 1;
+    for(int c = 0; c < nchars; c++) {
+      int n = collect_fonts(nchars > 1 ? global.matrix[c] : global.character);
+      for(int i = 0; i < n; i++) {
+        int id = global.results[i].id;
+        if(added != NULL) {
+          if(added[id])
+            continue;
+          added[id] = 1;
+        }
+        FcPattern *pat = global.allfs->fonts[id];
+        FcPatternReference(pat);
+        FcFontSetAdd(global.fs, pat);
+      }
+    }
+
+    free(added);
+    return 0;
+}
+
+/** Lists the requested code points as the columns of a matrix.
+ *
+ * \return Zero on success, negative if there are too many.
+ */
+int prepare_matrix()
+{
+    if(global.ncodepoints > MATRIXMAX) {
+      fprintf(stderr, "At most %d characters can be compared at once.\n", MATRIXMAX);
+      return -1;
+    }
+
+    global.matrix = (FcChar32 *)malloc(global.ncodepoints * sizeof(FcChar32));
+    if(global.matrix == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+
+    global.nmatrix = 0;
+    for(int r = 0; r < global.nranges; r++) {
+      for(uint32_t cp = global.ranges[r].first; cp <= global.ranges[r].last; cp++) {
+        global.matrix[global.nmatrix++] = cp;
+      }
+    }
+
+    return 0;
+}
+
+/** Prints the header line for a code point in batch output.
+ */
+void print_codepoint(uint32_t cp)
+{
+    struct unicode_nameannot info = lookup_info(cp);
+    char hexchar[11];
+    format_codepoint(hexchar, sizeof(hexchar), cp);
+
+    if(args.showname && (info.name != NULL)) {
+      printf("%s %s\n", hexchar, info.name);
+    } else {
+      printf("%s\n", hexchar);
+    }
+
+    if(args.showannot && (info.annot != NULL)) {
+      printf("%s\n", info.annot);
+    }
+}
+
+/** Prints the fonts containing each requested
+ *  code point, grouped by code point.
+ *
+ *  Without the index, code points are scanned in blocks
+ *  so each pass over the font set answers many of them.
+ */
+int generate_batch()
+{
+    uint32_t block[SCANBLOCK];
+    int nblock = 0;
+
+    if(reserve_results() < 0) {
+      return -1;
+    }
+
+    for(int r = 0; r < global.nranges; r++) {
+      for(uint32_t cp = global.ranges[r].first; cp <= global.ranges[r].last; cp++) {
+        if(global.index) {
+          if(args.format == FORMAT_TEXT)
+            print_codepoint(cp);
+          print_fonts(cp, "\t");
+          if(global.fallback)
+            print_fallback(cp, "\t");
+          continue;
+        }
+
+        block[nblock++] = cp;
+        int lastcp = (r == global.nranges - 1) && (cp == global.ranges[r].last);
+        if((nblock < SCANBLOCK) && !lastcp)
+          continue;
+
+        scan_codepoints(block, nblock);
+        for(int k = 0; k < nblock; k++) {
+          if(args.format == FORMAT_TEXT)
+            print_codepoint(block[k]);
+          print_results(block[k], rank_results(block[k], group_results(gather_fonts(k))), "\t");
+          if(global.fallback)
+            print_fallback(block[k], "\t");
+        }
+        nblock = 0;
+      }
+    }
+
+    return 0;
+}
+
+
+/** Reads UTF-8 text and streams every code point that no
+ *  candidate font contains, then prints a small set of fonts
+ *  that together cover the rest of the text.
+ *
+ * Input is processed in fixed size chunks; memory use is bounded
+ * by the number of distinct code points rather than text length.
+ */
+int generate_text_coverage(const char *path)
+{
+// Bytes of text decoded at a time
+#define TEXTCHUNK 65536
+
+    FILE *fp = stdin;
+    if((path != NULL) && (strcmp(path, "-") != 0)) {
+      fp = fopen(path, "r");
+      if(fp == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+      }
+    }
+
+    // Union of every font's charset answers "is it covered at all".
+    FcCharSet *coverage = FcCharSetCreate();
+    for(int i = 0; i < global.allfs->nfont; i++) {
+      if(global.charsets[i] != NULL) {
+        FcCharSetMerge(coverage, global.charsets[i], NULL);
+      }
+    }
+
+    FcCharSet *text = FcCharSetCreate();
+    unsigned char *inbuf = (unsigned char *)malloc(TEXTCHUNK);
+    uint32_t *cpbuf = (uint32_t *)malloc(TEXTCHUNK * sizeof(uint32_t));
+    if((inbuf == NULL) || (cpbuf == NULL)) {
+      fprintf(stderr, "Out of memory.\n");
+      free(inbuf);
+      free(cpbuf);
+      FcCharSetDestroy(text);
+      FcCharSetDestroy(coverage);
+      if(fp != stdin)
+        fclose(fp);
+      return -1;
+    }
+
+    struct utf8_decoder dec;
+    memset(&dec, 0, sizeof(dec));
+
+    size_t nread;
+    while((nread = fread(inbuf, 1, TEXTCHUNK, fp)) > 0) {
+      size_t ncp = utf8_decode(&dec, inbuf, nread, cpbuf);
+      for(size_t i = 0; i < ncp; i++) {
+        uint32_t cp = cpbuf[i];
+        // Control characters are never drawn.
+        if((cp < 0x20) || (cp == 0x7F) || FcCharSetHasChar(text, cp))
+          continue;
+        FcCharSetAddChar(text, cp);
+
+        if(!FcCharSetHasChar(coverage, cp)) {
+          char hexchar[11];
+          format_codepoint(hexchar, sizeof(hexchar), cp);
+          struct unicode_nameannot info = lookup_info(cp);
+          if(args.showname && (info.name != NULL)) {
+            printf("%s %s\n", hexchar, info.name);
+          } else {
+            printf("%s\n", hexchar);
+          }
+          fflush(stdout);
+        }
+      }
+    }
+
+    if(dec.need > 0) {
+      dec.invalid++;
+    }
+    if(dec.invalid > 0) {
+      fprintf(stderr, "Skipped %lu invalid UTF-8 sequences.\n", dec.invalid);
+    }
+
+    // Greedily pick the font covering the most remaining code points.
+    FcCharSet *remaining = FcCharSetIntersect(text, coverage);
+    int nfonts = 0;
+    printf("Covering fonts:\n");
+    while((remaining != NULL) && (FcCharSetCount(remaining) > 0)) {
+      int best = -1;
+      FcChar32 bestcount = 0;
+      for(int i = 0; i < global.allfs->nfont; i++) {
+        if(global.charsets[i] == NULL)
+          continue;
+        FcChar32 count = FcCharSetIntersectCount(remaining, global.charsets[i]);
+        if(count > bestcount) {
+          best = i;
+          bestcount = count;
+        }
+      }
+
+      if((best < 0) || ((args.maxfonts > 0) && (nfonts >= args.maxfonts)))
+        break;
+
+      struct fontinfo fi;
+      get_fontinfo(best, &fi);
+      printf("\t%s %s (%u)\n", fi.family, fi.style, bestcount);
+      nfonts++;
+
+      FcCharSet *rest = FcCharSetSubtract(remaining, global.charsets[best]);
+      FcCharSetDestroy(remaining);
+      remaining = rest;
+    }
+
+    if(remaining != NULL) {
+      FcCharSetDestroy(remaining);
+    }
+    free(inbuf);
+    free(cpbuf);
+    FcCharSetDestroy(text);
+    FcCharSetDestroy(coverage);
+    if(fp != stdin) {
+      fclose(fp);
+    }
+
+    return 0;
+}
+
+
+#ifdef HAVE_UNINAMESLIST_BLOCKCOUNT
+/** Prints one font and block entry of the coverage report
+ *  in a --format other than text.
+ */
+void print_coverage_record(const struct fontinfo *fi, const char *block, uint32_t covered,
+                           uint32_t size)
+{
+  switch(args.format) {
+  case FORMAT_JSONL:
+    fputs("{\"family\":", stdout);
+    write_json_string(stdout, fi->family);
+    fputs(",\"style\":", stdout);
+    write_json_string(stdout, fi->style);
+    fputs(",\"file\":", stdout);
+    write_json_string(stdout, fi->file);
+    fprintf(stdout, ",\"index\":%d,\"block\":", fi->index);
+    write_json_string(stdout, block);
+    fprintf(stdout, ",\"covered\":%u,\"size\":%u}\n", covered, size);
+    break;
+  case FORMAT_TSV:
+    write_tsv_field(stdout, fi->family);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->style);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->file);
+    fprintf(stdout, "\t%d\t", fi->index);
+    write_tsv_field(stdout, block);
+    fprintf(stdout, "\t%u\t%u\n", covered, size);
+    break;
+  case FORMAT_NUL:
+    printf("%s%c%s%c%s%c%d%c%s%c%u%c%u%c", fi->family, 0, fi->style, 0, fi->file, 0,
+           fi->index, 0, block, 0, covered, 0, size, 0);
+    break;
+  }
+}
+
+/** Prints one font's blocks in the coverage report.
+ */
+void print_coverage_font(const struct coverage *cov, int font, const struct fontinfo *fi)
+{
+  const uint32_t *row = cov->counts + (size_t)font * cov->nblocks;
+
+  int header = 0;
+  for(int b = 0; b < cov->nblocks; b++) {
+    if(row[b] == 0)
+      continue;
+    const char *name = uniNamesList_blockNameList(b);
+    uint32_t size = cov->last[b] - cov->first[b] + 1;
+    if(args.format != FORMAT_TEXT) {
+      print_coverage_record(fi, name, row[b], size);
+      continue;
+    }
+    if(!header) {
+      printf("%s %s\n", fi->family, fi->style);
+      header = 1;
+    }
+    printf("\t%-48s %6u/%u\n", name, row[b], size);
+  }
+}
+
+/** Prints how many code points of every Unicode block each
+ *  font covers, then the assigned code points of each block
+ *  that no font covers.
+ *
+ * Charsets are walked a page at a time and counted with popcounts,
+ * from the index when it's open or from fontconfig otherwise.
+ */
+int generate_coverage()
+{
+  struct coverage cov;
+  memset(&cov, 0, sizeof(cov));
+
+  cov.nblocks = uniNamesList_blockCount();
+  if(cov.nblocks <= 0) {
+    fprintf(stderr, "No Unicode block information available.\n");
+    return -1;
+  }
+  cov.nfonts = global.index ? (int)global.index->nfonts : global.allfs->nfont;
+
+  int ret = -1;
+  cov.first = (uint32_t *)malloc(cov.nblocks * sizeof(uint32_t));
+  cov.last = (uint32_t *)malloc(cov.nblocks * sizeof(uint32_t));
+  cov.counts = (uint32_t *)calloc((size_t)(cov.nfonts + 1) * cov.nblocks, sizeof(uint32_t));
+  cov.any = (uint64_t *)calloc(0x110000 / 64, sizeof(uint64_t));
+  if((cov.first == NULL) || (cov.last == NULL) || (cov.counts == NULL) || (cov.any == NULL)) {
+    fprintf(stderr, "Out of memory.\n");
+    goto done;
+  }
+  for(int b = 0; b < cov.nblocks; b++) {
+    cov.first[b] = (uint32_t)uniNamesList_blockStart(b);
+    cov.last[b] = (uint32_t)uniNamesList_blockEnd(b);
+  }
+
+  walk_font_pages(coverage_add_page, &cov);
+
+  for(int f = 0; f < cov.nfonts; f++) {
+    struct fontinfo fi;
+    if(global.index) {
+      if(index_fontinfo(f, &fi) < 0)
+        continue;
+    } else {
+      get_fontinfo(f, &fi);
+    }
+    print_coverage_font(&cov, f, &fi);
+  }
+
+  // Assigned code points without a glyph anywhere, by block. Records
+  // for this have an empty family and count the covered ones.
+  struct fontinfo nofont = { "", "", "", -1, -1 };
+  if(args.format == FORMAT_TEXT) {
+    printf("Not covered by any font:\n");
+  }
+  for(int b = 0; b < cov.nblocks; b++) {
+    uint32_t assigned = 0, missing = 0;
+    for(uint32_t cp = cov.first[b]; cp <= cov.last[b]; cp++) {
+      if(uniNamesList_name(cp) == NULL)
+        continue;
+      assigned++;
+      if(!union_has(cov.any, cp))
+        missing++;
+    }
+    if(missing == 0)
+      continue;
+    if(args.format == FORMAT_TEXT) {
+      printf("\t%-48s %6u/%u\n", uniNamesList_blockNameList(b), missing, assigned);
+    } else {
+      print_coverage_record(&nofont, uniNamesList_blockNameList(b), assigned - missing, assigned);
+    }
+  }
+  ret = 0;
+
+done:
+  free(cov.first);
+  free(cov.last);
+  free(cov.counts);
+  free(cov.any);
+  return ret;
+}
+#else
+int generate_coverage()
+{
+  fprintf(stderr, "This libuninameslist has no Unicode block information.\n");
+  return -1;
+}
+#endif
+
+/** Prints the assigned code points among those requested that no
+ *  candidate font covers, with their names.
+ *
+ * The fonts' charsets are ORed together once, so each code point
+ * costs a bit test rather than a font query.
+ */
+int generate_gaps()
+{
+  uint64_t *any = build_union();
+  if(any == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+
+  uint32_t missing = 0;
+  for(int r = 0; r < global.nranges; r++) {
+    for(uint32_t cp = global.ranges[r].first; cp <= global.ranges[r].last; cp++) {
+      const char *name = uniNamesList_name(cp);
+      if((name == NULL) || union_has(any, cp))
+        continue;
+      missing++;
+
+      char hexchar[11];
+      format_codepoint(hexchar, sizeof(hexchar), cp);
+      switch(args.format) {
+      case FORMAT_JSONL:
+        fprintf(stdout, "{\"codepoint\":\"%s\",\"name\":", hexchar);
+        write_json_string(stdout, name);
+        fputs("}\n", stdout);
+        break;
+      case FORMAT_TSV:
+        fprintf(stdout, "%s\t", hexchar);
+        write_tsv_field(stdout, name);
+        putc('\n', stdout);
+        break;
+      case FORMAT_NUL:
+        printf("%s%c%s%c", hexchar, 0, name, 0);
+        break;
+      default:
+        printf("%s %s\n", hexchar, name);
+        break;
+      }
+    }
+  }
+  stats_count("uncovered code points", missing);
+
+  free(any);
+  return 0;
+}
+
+// In-memory RGBA image for headless export.
+struct image {
+  int width;
+  int height;
+  unsigned char *pixels;  // 4 bytes per pixel
+};
+
+// Clipping rectangle for drawing into an image.
+struct cliprect {
+  int x0, y0;  // Inclusive
+  int x1, y1;  // Exclusive
+};
+
+// Resolution fontconfig point sizes are converted at.
+#define EXPORTDPI 96.0
+
+/** Fills a rectangle with a gray level.
+ */
+void image_fill(struct image *img, int x, int y, int w, int h, unsigned char gray)
+{
+  if(x < 0) { w += x; x = 0; }
+  if(y < 0) { h += y; y = 0; }
+  if(x + w > img->width)
+    w = img->width - x;
+  if(y + h > img->height)
+    h = img->height - y;
+
+  for(int j = y; j < y + h; j++) {
+    unsigned char *p = img->pixels + 4 * ((size_t)j * img->width + x);
+    for(int i = 0; i < w; i++, p += 4) {
+      p[0] = p[1] = p[2] = gray;
+      p[3] = 255;
+    }
+  }
+}
+
+/** Draws a rectangle outline BDRWIDTH wide, centered on
+ *  the edges like XDrawRectangle().
+ */
+void image_rectangle(struct image *img, int x, int y, int w, int h)
+{
+  int lo = BDRWIDTH / 2;
+  image_fill(img, x - lo, y - lo, w + BDRWIDTH, BDRWIDTH, 0);
+  image_fill(img, x - lo, y + h - lo, w + BDRWIDTH, BDRWIDTH, 0);
+  image_fill(img, x - lo, y - lo, BDRWIDTH, h + BDRWIDTH, 0);
+  image_fill(img, x + w - lo, y - lo, BDRWIDTH, h + BDRWIDTH, 0);
+}
+
+/** Composites a rendered glyph in black (or its own colors)
+ *  with its top-left corner at (x, y).
+ */
+void image_blit(struct image *img, const FT_Bitmap *bm, int x, int y, const struct cliprect *clip)
+{
+  for(unsigned int row = 0; row < bm->rows; row++) {
+    int py = y + (int)row;
+    if((py < clip->y0) || (py >= clip->y1))
+      continue;
+    const unsigned char *src = bm->buffer + (long)row * bm->pitch;
+    for(unsigned int col = 0; col < bm->width; col++) {
+      int px = x + (int)col;
+      if((px < clip->x0) || (px >= clip->x1))
+        continue;
+
+      unsigned char *p = img->pixels + 4 * ((size_t)py * img->width + px);
+      unsigned int a;
+      switch(bm->pixel_mode) {
+      case FT_PIXEL_MODE_MONO:
+        a = (src[col >> 3] & (0x80 >> (col & 7))) ? 255 : 0;
+        break;
+      case FT_PIXEL_MODE_BGRA:
+        // Premultiplied color.
+        a = src[4 * col + 3];
+        p[0] = src[4 * col + 2] + p[0] * (255 - a) / 255;
+        p[1] = src[4 * col + 1] + p[1] * (255 - a) / 255;
+        p[2] = src[4 * col + 0] + p[2] * (255 - a) / 255;
+        continue;
+      default:
+        a = src[col];
+        break;
+      }
+      p[0] = p[0] * (255 - a) / 255;
+      p[1] = p[1] * (255 - a) / 255;
+      p[2] = p[2] * (255 - a) / 255;
+    }
+  }
+}
+
+/** Opens a font face and sets its pixel size, picking the
+ *  closest strike for fonts that only have bitmaps.
+ *
+ * \return The face, or NULL on error.
+ */
+FT_Face open_face(FT_Library lib, const char *file, int index, double pixels)
+{
+  FT_Face face;
+  if(FT_New_Face(lib, file, index, &face) != 0) {
+    return NULL;
+  }
+
+  if(FT_Set_Pixel_Sizes(face, 0, (FT_UInt)(pixels + 0.5)) != 0) {
+    if(face->num_fixed_sizes <= 0) {
+      FT_Done_Face(face);
+      return NULL;
+    }
+    int best = 0;
+    for(int i = 1; i < face->num_fixed_sizes; i++) {
+      if(abs(face->available_sizes[i].height - (int)pixels) <
+         abs(face->available_sizes[best].height - (int)pixels))
+        best = i;
+    }
+    FT_Select_Size(face, best);
+  }
+
+  return face;
+}
+
+/** Measures the advance width of a UTF-8 string.
+ */
+int text_width(FT_Face face, const char *text)
+{
+  struct utf8_decoder dec;
+  memset(&dec, 0, sizeof(dec));
+  int width = 0;
+  for(const unsigned char *p = (const unsigned char *)text; *p; p++) {
+    uint32_t cp;
+    if(utf8_decode(&dec, p, 1, &cp) && (FT_Load_Char(face, cp, FT_LOAD_DEFAULT) == 0)) {
+      width += face->glyph->advance.x >> 6;
+    }
+  }
+  return width;
+}
+
+/** Draws a UTF-8 string starting at a baseline point.
+ */
+void draw_text(struct image *img, FT_Face face, const char *text, int x, int y,
+               const struct cliprect *clip)
+{
+  struct utf8_decoder dec;
+  memset(&dec, 0, sizeof(dec));
+  for(const unsigned char *p = (const unsigned char *)text; *p; p++) {
+    uint32_t cp;
+    if(!utf8_decode(&dec, p, 1, &cp) ||
+       (FT_Load_Char(face, cp, FT_LOAD_RENDER | FT_LOAD_COLOR) != 0))
+      continue;
+    FT_GlyphSlot g = face->glyph;
+    image_blit(img, &g->bitmap, x + g->bitmap_left, y - g->bitmap_top, clip);
+    x += g->advance.x >> 6;
+  }
+}
+
+/** Draws the characters of one grid box from a face, placed
+ *  as in the window.
+ *
+ * \param rx, ry Top-left corner of the box in the image.
+ * \param character The gl->ncols characters to render.
+ */
+void draw_box_glyphs(struct image *img, FT_Face face, const struct grid_layout *gl,
+                     const uint32_t *character, int rx, int ry, const struct cliprect *clip)
+{
+  int descent = (int)(-face->size->metrics.descender >> 6);
+  int y = ry + gl->fh + (gl->ch + gl->crh) / 2 - descent;
+  for(int c = 0; c < gl->ncols; c++) {
+    FT_UInt glyph = FT_Get_Char_Index(face, character[c]);
+    // Matrix cells stay empty where the font lacks the character.
+    if((glyph == 0) && (gl->ncols > 1))
+      continue;
+    if(FT_Load_Glyph(face, glyph, FT_LOAD_RENDER | FT_LOAD_COLOR) != 0)
+      continue;
+
+    FT_GlyphSlot g = face->glyph;
+    int xadjust = (gl->cw - (int)g->bitmap.width) / 2;
+    int x = rx + gl->lw + c * gl->colw + HPADDING + (xadjust > 0 ? xadjust : 0);
+    image_blit(img, &g->bitmap, x + g->bitmap_left, y - g->bitmap_top, clip);
+  }
+}
+
+// Work shared by the threads rendering one exported page.
+struct export_job {
+  const struct grid_layout *gl;
+  struct image *img;
+  int yoffset;
+  uint32_t character;
+  const struct fontinfo *fonts;  // Fonts on this page
+  int nfonts;
+  const char *labelfile;         // Font for family names
+  int labelindex;
+  double labelsize;
+  int next;                      // Next box to claim
+  int workers;                   // Threads started, for trace ids
+};
+
+/** Renders boxes of an exported page until none are left.
+ *
+ * Each box is claimed atomically and drawing is clipped to
+ * the box, so threads never touch the same pixels.
+ */
+void *export_worker(void *arg)
+{
+  struct export_job *job = (struct export_job *)arg;
+  const struct grid_layout *gl = job->gl;
+
+  FT_Library lib;
+  if(FT_Init_FreeType(&lib) != 0) {
+    return NULL;
+  }
+  FT_Face label = open_face(lib, job->labelfile, job->labelindex, job->labelsize);
+  trace_tid = __atomic_fetch_add(&job->workers, 1, __ATOMIC_RELAXED);
+
+  int cell;
+  while((cell = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nfonts) {
+    const struct fontinfo *fi = &job->fonts[cell];
+    double start = trace_begin();
+    int rx = (cell % gl->nw) * gl->bw;
+    int ry = (cell / gl->nw) * gl->bh + job->yoffset;
+    struct cliprect clip = { rx + BDRWIDTH / 2 + 1, ry + BDRWIDTH / 2 + 1,
+                             rx + gl->bw - BDRWIDTH / 2, ry + gl->bh - BDRWIDTH / 2 };
+
+    if(label != NULL) {
+      int xadjust = (gl->cw - text_width(label, fi->family)) / 2;
+      draw_text(job->img, label, fi->family,
+                rx + HPADDING + (xadjust > 0 ? xadjust : 0),
+                ry + gl->frh + VPADDING, &clip);
+    }
+
+    double step = trace_begin();
+    FT_Face face = open_face(lib, fi->file, fi->index, (double)gl->crh);
+    trace_end("font open", fi->file, step);
+    if(face == NULL) {
+      DBG("Could not open %s\n", fi->file);
+      trace_end("cell", fi->family, start);
+      continue;
+    }
+    step = trace_begin();
+    draw_box_glyphs(job->img, face, gl, &job->character, rx, ry, &clip);
+    trace_end("draw", fi->family, step);
+    FT_Done_Face(face);
+    trace_end("cell", fi->family, start);
+  }
+
+  if(label != NULL) {
+    FT_Done_Face(label);
+  }
+  FT_Done_FreeType(lib);
+
+  return NULL;
+}
+
+#ifndef FC_CHAR_LITE
+// A grid box rendered by a cell worker, waiting for the X thread.
+struct cell_image {
+  struct cell_image *next;
+  unsigned long generation;  // Posting it was rendered for
+  int font;                  // Index in the found font set
+  int x, y;                  // Interior of the box in the window
+  struct image img;          // In X pixel values if cells.direct is set
+};
+
+// Threads loading fonts and rendering grid boxes with FreeType,
+// so slow fonts never hold up the X thread. Only the X thread
+// calls Xlib; finished boxes come back on a lock-free stack.
+struct {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_t *threads;
+  int nthreads;
+  int workers;               // Trace ids handed out
+  int quit;
+  // Work for the page on screen, under lock.
+  unsigned long generation;
+  struct grid_layout layout;
+  int first;                 // Font in the page's first box
+  int yoffset;
+  FcChar32 character[MATRIXMAX];
+  int *boxes;                // Fonts whose boxes are still to render
+  int nboxes;
+  int nextbox;
+  int posted;                // gridpasses the work was posted for
+  // Files and families of the found fonts, for the workers.
+  const char **files;
+  int *indexes;
+  const char **families;     // Trace labels
+  int facemax;               // Faces each worker keeps open
+  // Finished boxes: pushed by workers, taken whole by the X thread.
+  struct cell_image *done;
+  struct cell_image *ready;  // Taken from done, oldest first
+  int wakefd[2];             // Wakes the X thread when boxes are pushed
+  int wakepending;
+  // Layout of the visual's pixels, for converting in the workers.
+  int truecolor;             // If pixels are made of red, green and blue bits
+  int direct;                // If 32 bit pixels can be written directly
+  int shift[3];
+  int bits[3];
+} cells = { .wakefd = { -1, -1 } };
+
+/** Returns the X pixel value for an RGBA pixel. Without a
+ *  TrueColor visual it is black or white.
+ */
+unsigned long rgb_pixel(const unsigned char *p)
+{
+  if(!cells.truecolor) {
+    return (p[0] + p[1] + p[2] >= 3 * 128) ? global.white.pixel : global.black.pixel;
+  }
+
+  unsigned long v = 0;
+  for(int c = 0; c < 3; c++) {
+    v |= ((unsigned long)p[c] * ((1ul << cells.bits[c]) - 1) / 255) << cells.shift[c];
+  }
+  return v;
+}
+
+/** Converts an RGBA image to 32 bit pixel values of the X visual,
+ *  in place.
+ */
+void image_to_pixels(struct image *img)
+{
+  uint32_t *px = (uint32_t *)img->pixels;
+  size_t n = (size_t)img->width * img->height;
+  for(size_t i = 0; i < n; i++) {
+    px[i] = (uint32_t)rgb_pixel(img->pixels + 4 * i);
+  }
+}
+
+// Open font files kept by all cell workers together.
+#define FACEBUDGET 256
+
+// One worker's faces for the found fonts, opened at size and kept
+// across pages and repaints until the cell size changes.
+struct face_cache {
+  FT_Library lib;
+  FT_Face *faces;            // By index in the found font set
+  unsigned long *used;       // Clock at last use, for eviction
+  unsigned long clock;
+  int nopen;
+  double size;
+};
+
+/** Closes every face in a worker's cache.
+ */
+void flush_faces(struct face_cache *fc)
+{
+  for(int i = 0; (fc->nopen > 0) && (i < global.fs->nfont); i++) {
+    if(fc->faces[i] != NULL) {
+      FT_Done_Face(fc->faces[i]);
+      fc->faces[i] = NULL;
+      fc->nopen--;
+    }
+  }
+}
+
+/** Returns a worker's face for a found font at the given size,
+ *  opening it if needed. Past cells.facemax open faces the least
+ *  recently used one is closed.
+ *
+ * \return The face, or NULL if it could not be opened.
+ */
+FT_Face cached_face(struct face_cache *fc, int font, double size)
+{
+  if(size != fc->size) {
+    DBG("Cell size changed, closing faces\n");
+    flush_faces(fc);
+    fc->size = size;
+  }
+
+  fc->used[font] = ++fc->clock;
+  if(fc->faces[font] != NULL) {
+    return fc->faces[font];
+  }
+
+  if(fc->nopen >= cells.facemax) {
+    int old = -1;
+    for(int i = 0; i < global.fs->nfont; i++) {
+      if((fc->faces[i] != NULL) && ((old < 0) || (fc->used[i] < fc->used[old])))
+        old = i;
+    }
+    if(old >= 0) {
+      FT_Done_Face(fc->faces[old]);
+      fc->faces[old] = NULL;
+      fc->nopen--;
+    }
+  }
+
+  double start = trace_begin();
+  fc->faces[font] = open_face(fc->lib, cells.files[font], cells.indexes[font], size);
+  trace_end("font open", cells.files[font], start);
+  if(fc->faces[font] != NULL)
+    fc->nopen++;
+  return fc->faces[font];
+}
+
+/** Renders one box of the grid, without its name, into an
+ *  image the size of the box's interior.
+ *
+ * \return The box, or NULL if out of memory.
+ */
+struct cell_image *render_box(struct face_cache *fc, int font, unsigned long generation,
+                              const struct grid_layout *gl, int first, int yoffset,
+                              const FcChar32 *character)
+{
+  struct cell_image *ci = (struct cell_image *)calloc(1, sizeof(*ci));
+  if(ci == NULL) {
+    return NULL;
+  }
+
+  int cell = font - first;
+  int rx = (cell % gl->nw) * gl->bw;
+  int ry = (cell / gl->nw) * gl->bh + yoffset;
+  ci->generation = generation;
+  ci->font = font;
+  ci->x = rx + 1;
+  ci->y = ry + 1;
+  ci->img.width = gl->bw - 2;
+  ci->img.height = gl->bh - 2;
+  ci->img.pixels = (unsigned char *)malloc(4 * (size_t)ci->img.width * ci->img.height);
+  if(ci->img.pixels == NULL) {
+    free(ci);
+    return NULL;
+  }
+  image_fill(&ci->img, 0, 0, ci->img.width, ci->img.height, 255);
+
+  FT_Face face = cached_face(fc, font, (double)gl->crh);
+  if(face != NULL) {
+    double start = trace_begin();
+    struct cliprect clip = { 0, 0, ci->img.width, ci->img.height };
+    draw_box_glyphs(&ci->img, face, gl, character, -1, -1, &clip);
+    trace_end("draw", cells.files[font], start);
+  } else {
+    DBG("Could not open %s\n", cells.files[font]);
+  }
+
+  if(cells.direct)
+    image_to_pixels(&ci->img);
+  return ci;
+}
+
+/** Hands a finished box to the X thread and wakes it up
+ *  unless a wakeup is already on its way.
+ */
+void push_cell(struct cell_image *ci)
+{
+  ci->next = __atomic_load_n(&cells.done, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&cells.done, &ci->next, ci, 1,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  if(__atomic_exchange_n(&cells.wakepending, 1, __ATOMIC_ACQ_REL) == 0) {
+    char c = 0;
+    while((write(cells.wakefd[1], &c, 1) < 0) && (errno == EINTR))
+      ;
+  }
+}
+
+/** Renders boxes as the X thread posts them until told to quit.
+ */
+void *cell_worker(void *arg)
+{
+  struct face_cache fc;
+  memset(&fc, 0, sizeof(fc));
+  fc.faces = (FT_Face *)calloc(global.fs->nfont + 1, sizeof(*fc.faces));
+  fc.used = (unsigned long *)calloc(global.fs->nfont + 1, sizeof(*fc.used));
+  if((fc.faces == NULL) || (fc.used == NULL) || (FT_Init_FreeType(&fc.lib) != 0)) {
+    free(fc.faces);
+    free(fc.used);
+    return NULL;
+  }
+  trace_tid = __atomic_add_fetch(&cells.workers, 1, __ATOMIC_RELAXED);
+
+  FcChar32 character[MATRIXMAX];
+  pthread_mutex_lock(&cells.lock);
+  while(!cells.quit) {
+    if(cells.nextbox >= cells.nboxes) {
+      pthread_cond_wait(&cells.start, &cells.lock);
+      continue;
+    }
+
+    int font = cells.boxes[cells.nextbox++];
+    unsigned long generation = cells.generation;
+    struct grid_layout gl = cells.layout;
+    int first = cells.first, yoffset = cells.yoffset;
+    memcpy(character, cells.character, gl.ncols * sizeof(*character));
+    pthread_mutex_unlock(&cells.lock);
+
+    double start = trace_begin();
+    struct cell_image *ci = render_box(&fc, font, generation, &gl, first, yoffset, character);
+    trace_end("cell", cells.families[font], start);
+    if(ci != NULL)
+      push_cell(ci);
+
+    pthread_mutex_lock(&cells.lock);
+  }
+  pthread_mutex_unlock(&cells.lock);
+
+  flush_faces(&fc);
+  free(fc.faces);
+  free(fc.used);
+  FT_Done_FreeType(fc.lib);
+  return NULL;
+}
+
+/** Frees a list of boxes.
+ */
+void free_cells(struct cell_image *ci)
+{
+  while(ci != NULL) {
+    struct cell_image *next = ci->next;
+    free(ci->img.pixels);
+    free(ci);
+    ci = next;
+  }
+}
+
+/** Starts args.jobs cell workers, at least one, for the found fonts.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int start_cells()
+{
+  int n = global.fs->nfont;
+  cells.files = (const char **)calloc(n + 1, sizeof(*cells.files));
+  cells.indexes = (int *)calloc(n + 1, sizeof(*cells.indexes));
+  cells.families = (const char **)calloc(n + 1, sizeof(*cells.families));
+  cells.boxes = (int *)calloc(n + 1, sizeof(*cells.boxes));
+  if((cells.files == NULL) || (cells.indexes == NULL) || (cells.families == NULL) ||
+     (cells.boxes == NULL)) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  for(int i = 0; i < n; i++) {
+    FcChar8 *file;
+    if(FcPatternGetString(global.fs->fonts[i], FC_FILE, 0, &file) != FcResultMatch)
+      file = (FcChar8 *)"";
+    cells.files[i] = (const char *)file;
+    if(FcPatternGetInteger(global.fs->fonts[i], FC_INDEX, 0, &cells.indexes[i]) != FcResultMatch)
+      cells.indexes[i] = 0;
+    FcChar8 *famname;
+    if(FcPatternGetString(global.fs->fonts[i], FC_FAMILY, 0, &famname) != FcResultMatch)
+      famname = (FcChar8 *)"";
+    cells.families[i] = (const char *)famname;
+  }
+
+  if(pipe(cells.wakefd) < 0) {
+    fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+    cells.wakefd[0] = cells.wakefd[1] = -1;
+    return -1;
+  }
+  for(int i = 0; i < 2; i++) {
+    fcntl(cells.wakefd[i], F_SETFL, O_NONBLOCK);
+    fcntl(cells.wakefd[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  // Workers write 32 bit TrueColor pixels themselves; anything
+  // else is converted on the X thread.
+  Visual *visual = XDefaultVisual(global.dpy, XDefaultScreen(global.dpy));
+  XImage *probe = XCreateImage(global.dpy, visual, DefaultDepth(global.dpy, XDefaultScreen(global.dpy)),
+                               ZPixmap, 0, NULL, 1, 1, 32, 0);
+  unsigned long masks[3] = { visual->red_mask, visual->green_mask, visual->blue_mask };
+  cells.truecolor = (masks[0] != 0) && (masks[1] != 0) && (masks[2] != 0);
+  cells.direct = (probe != NULL) && (probe->bits_per_pixel == 32) && cells.truecolor;
+  if(probe != NULL)
+    XDestroyImage(probe);
+  for(int c = 0; c < 3; c++) {
+    cells.shift[c] = masks[c] ? __builtin_ctzl(masks[c]) : 0;
+    cells.bits[c] = __builtin_popcountl(masks[c]);
+  }
+  DBG("Cell pixels %s\n", cells.direct ? "written by workers" : "converted by X thread");
+
+  int jobs = default_jobs();
+  cells.threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+  if(cells.threads == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  cells.facemax = FACEBUDGET / jobs > 8 ? FACEBUDGET / jobs : 8;
+  pthread_mutex_init(&cells.lock, NULL);
+  pthread_cond_init(&cells.start, NULL);
+  for(int t = 0; t < jobs; t++) {
+    if(pthread_create(&cells.threads[t], NULL, cell_worker, NULL) != 0)
+      break;
+    cells.nthreads = t + 1;
+  }
+  if(cells.nthreads == 0) {
+    fprintf(stderr, "Could not start cell workers.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Stops the cell workers and drops any boxes not put on screen.
+ */
+void stop_cells()
+{
+  if(cells.nthreads > 0) {
+    pthread_mutex_lock(&cells.lock);
+    cells.quit = 1;
+    pthread_cond_broadcast(&cells.start);
+    pthread_mutex_unlock(&cells.lock);
+    for(int t = 0; t < cells.nthreads; t++) {
+      pthread_join(cells.threads[t], NULL);
+    }
+    pthread_cond_destroy(&cells.start);
+    pthread_mutex_destroy(&cells.lock);
+    cells.nthreads = 0;
+  }
+
+  free_cells(cells.done);
+  free_cells(cells.ready);
+  cells.done = cells.ready = NULL;
+  free(cells.threads);
+  free(cells.files);
+  free(cells.indexes);
+  free(cells.families);
+  free(cells.boxes);
+  cells.threads = NULL;
+  cells.files = NULL;
+  cells.indexes = NULL;
+  cells.families = NULL;
+  cells.boxes = NULL;
+  for(int i = 0; i < 2; i++) {
+    if(cells.wakefd[i] >= 0)
+      close(cells.wakefd[i]);
+    cells.wakefd[i] = -1;
+  }
+}
+
+/** Gives the workers the boxes of the page just laid out that
+ *  aren't drawn yet. Boxes still rendering for an earlier page
+ *  are dropped when they arrive.
+ */
+void post_cells(const struct grid_layout *gl, const FcChar32 *character)
+{
+  int first = global.page * gl->perpage;
+  int last = first + gl->perpage;
+  if(last > gl->count)
+    last = gl->count;
+
+  pthread_mutex_lock(&cells.lock);
+  cells.generation++;
+  cells.layout = *gl;
+  cells.first = first;
+  cells.yoffset = global.gridoffset;
+  memcpy(cells.character, character, gl->ncols * sizeof(*character));
+  cells.nboxes = 0;
+  cells.nextbox = 0;
+  for(int i = first; i < last; i++) {
+    if(!global.celldone[i])
+      cells.boxes[cells.nboxes++] = i;
+  }
+  pthread_cond_broadcast(&cells.start);
+  pthread_mutex_unlock(&cells.lock);
+
+  cells.posted = global.gridpasses;
+}
+
+/** Checks if draw_cells() has anything to do: a page to post,
+ *  even one made only of tiles so that stale work is dropped,
+ *  or boxes to put on screen.
+ */
+int cells_waiting()
+{
+  return (cells.posted != global.gridpasses) || (cells.ready != NULL) ||
+         (__atomic_load_n(&cells.done, __ATOMIC_ACQUIRE) != NULL);
+}
+
+/** Copies a rendered box into the drawable.
+ */
+void put_cell(struct cell_image *ci)
+{
+  Visual *visual = XDefaultVisual(global.dpy, XDefaultScreen(global.dpy));
+  int depth = DefaultDepth(global.dpy, XDefaultScreen(global.dpy));
+  XImage *ximg = XCreateImage(global.dpy, visual, depth, ZPixmap, 0, NULL,
+                              ci->img.width, ci->img.height, 32, 0);
+  if(ximg == NULL) {
+    return;
+  }
+
+  if(cells.direct) {
+    // The workers wrote host order pixels; Xlib swaps if need be.
+    ximg->data = (char *)ci->img.pixels;
+    ximg->bytes_per_line = 4 * ci->img.width;
+    uint16_t probe = 1;
+    ximg->byte_order = *(unsigned char *)&probe ? LSBFirst : MSBFirst;
+    ci->img.pixels = NULL;
+  } else {
+    ximg->data = (char *)malloc((size_t)ximg->bytes_per_line * ci->img.height);
+    if(ximg->data == NULL) {
+      XDestroyImage(ximg);
+      return;
+    }
+    for(int y = 0; y < ci->img.height; y++) {
+      for(int x = 0; x < ci->img.width; x++) {
+        XPutPixel(ximg, x, y, rgb_pixel(ci->img.pixels + 4 * ((size_t)y * ci->img.width + x)));
+      }
+    }
+  }
+
+  XPutImage(global.dpy, global.draw, global.xgc, ximg, 0, 0, ci->x, ci->y,
+            ci->img.width, ci->img.height);
+  XDestroyImage(ximg);
+}
+
+/** Puts the next few boxes rendered by the cell workers on
+ *  screen, with their names, and makes them visible. Posts the
+ *  page's boxes first if it was just laid out.
+ *
+ * \param max Most boxes to put on screen.
+ * \param character The gl->ncols characters being shown.
+ * \return Number of boxes still waiting to be drawn, negative
+ *         if the names can't be drawn.
+ */
+int draw_cells(const struct grid_layout *gl, int max, const FcChar32 *character)
+{
+  __atomic_store_n(&cells.wakepending, 0, __ATOMIC_RELEASE);
+  XftFont *fnfont = gen_scale_title_font(FTNAMEFT, gl->fw, gl->frh);
+  if(fnfont == NULL) {
+    // generate_grid() drew nothing either: drop the page's work.
+    if(cells.posted != global.gridpasses) {
+      pthread_mutex_lock(&cells.lock);
+      cells.generation++;
+      cells.nboxes = cells.nextbox = 0;
+      pthread_mutex_unlock(&cells.lock);
+      cells.posted = global.gridpasses;
+    }
+    free_cells(__atomic_exchange_n(&cells.done, NULL, __ATOMIC_ACQUIRE));
+    free_cells(cells.ready);
+    cells.ready = NULL;
+    return -1;
+  }
+
+  if(cells.posted != global.gridpasses) {
+    post_cells(gl, character);
+  }
+
+  // Take everything pushed so far, oldest first.
+  struct cell_image *taken = __atomic_exchange_n(&cells.done, NULL, __ATOMIC_ACQUIRE);
+  struct cell_image *fresh = NULL;
+  while(taken != NULL) {
+    struct cell_image *next = taken->next;
+    taken->next = fresh;
+    fresh = taken;
+    taken = next;
+  }
+  struct cell_image **tail = &cells.ready;
+  while(*tail != NULL)
+    tail = &(*tail)->next;
+  *tail = fresh;
+
+  // Bounding rows of the boxes drawn, to limit the copy.
+  int top = -1, bottom = -1;
+  struct cell_image *put = NULL;
+  while((cells.ready != NULL) && (max > 0)) {
+    struct cell_image *ci = cells.ready;
+    cells.ready = ci->next;
+    ci->next = NULL;
+    if((ci->generation != cells.generation) || global.celldone[ci->font]) {
+      free_cells(ci);
+      continue;
+    }
+
+    double start = trace_begin();
+    put_cell(ci);
+    // The image covers the box's name; it is put back with the
+    // others in one request.
+    queue_label(gl, fnfont, ci->font, ci->x - 1, ci->y - 1);
+    trace_end("put cell", global.families[ci->font], start);
+
+    global.celldone[ci->font] = 1;
+    global.cellsleft--;
+    max--;
+
+    int row = (ci->y - 1 - global.gridoffset) / gl->bh;
+    if((top < 0) || (row < top))
+      top = row;
+    if(row > bottom)
+      bottom = row;
+    ci->next = put;
+    put = ci;
+  }
+
+  if(top >= 0) {
+    flush_text();
+    // Matrix lines over every row touched, including ones between
+    // that already had them.
+    draw_separators(gl, global.gridoffset + top * gl->bh, bottom - top + 1);
+    for(struct cell_image *ci = put; ci != NULL; ci = ci->next) {
+      store_tile(ci->font, ci->x, ci->y, gl->bw - 1, gl->bh - 1);
+    }
+    free_cells(put);
+
+    show_buffer(0, global.gridoffset + top * gl->bh, gl->width,
+                (bottom - top + 1) * gl->bh + BDRWIDTH);
+  }
+
+  return global.cellsleft;
+}
+
+#endif
+
+/** Finds the file fontconfig would use for a family name.
+ *
+ * \return Newly allocated file name, or NULL if none matched.
+ */
+char *match_font_file(const char *family, int *index)
+{
+  init_fontconfig();
+  FcPattern *pat = FcNameParse((const FcChar8 *)family);
+  if(pat == NULL) {
+    return NULL;
+  }
+  FcConfigSubstitute(NULL, pat, FcMatchPattern);
+  FcDefaultSubstitute(pat);
+
+  FcResult result;
+  FcPattern *match = FcFontMatch(NULL, pat, &result);
+  FcPatternDestroy(pat);
+  if(match == NULL) {
+    return NULL;
+  }
+
+  char *file = NULL;
+  FcChar8 *str;
+  if(FcPatternGetString(match, FC_FILE, 0, &str) == FcResultMatch) {
+    file = strdup((char *)str);
+  }
+  if(FcPatternGetInteger(match, FC_INDEX, 0, index) != FcResultMatch) {
+    *index = 0;
+  }
+  FcPatternDestroy(match);
+
+  return file;
+}
+
+/** Writes an image as binary PPM, dropping alpha.
+ */
+int write_ppm(const char *path, const struct image *img)
+{
+  FILE *fp = fopen(path, "wb");
+  if(fp == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fprintf(fp, "P6\n%d %d\n255\n", img->width, img->height);
+  unsigned char *row = (unsigned char *)malloc(3 * (size_t)img->width);
+  if(row == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  for(int y = 0; y < img->height; y++) {
+    const unsigned char *p = img->pixels + 4 * (size_t)y * img->width;
+    for(int x = 0; x < img->width; x++) {
+      row[3 * x + 0] = p[4 * x + 0];
+      row[3 * x + 1] = p[4 * x + 1];
+      row[3 * x + 2] = p[4 * x + 2];
+    }
+    fwrite(row, 3, img->width, fp);
+  }
+  free(row);
+
+  if(fclose(fp) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_LIBPNG
+/** Writes an image as RGBA PNG.
+ */
+int write_png(const char *path, const struct image *img)
+{
+  FILE *fp = fopen(path, "wb");
+  if(fp == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png ? png_create_info_struct(png) : NULL;
+  if((png == NULL) || (info == NULL) || setjmp(png_jmpbuf(png))) {
+    fprintf(stderr, "Error writing %s\n", path);
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    return -1;
+  }
+
+  png_init_io(png, fp);
+  png_set_IHDR(png, info, img->width, img->height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for(int y = 0; y < img->height; y++) {
+    png_write_row(png, img->pixels + 4 * (size_t)y * img->width);
+  }
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+
+  return fclose(fp) == 0 ? 0 : -1;
+}
+#endif
+
+/** Writes an image in the format given by the file extension:
+ *  PNG for .png, binary PPM otherwise.
+ */
+int write_image(const char *path, const struct image *img)
+{
+  const char *ext = strrchr(path, '.');
+  if((ext != NULL) && (strcasecmp(ext, ".png") == 0)) {
+#ifdef HAVE_LIBPNG
+    return write_png(path, img);
+#else
+    fprintf(stderr, "PNG support not built in, use a .ppm file name.\n");
+    return -1;
+#endif
+  }
+  return write_ppm(path, img);
+}
+
+/** Builds the name of one exported sheet, adding the code point
+ *  and page number before the extension when there are several.
+ */
+void export_filename(char *buf, size_t size, uint32_t character, int page, int npages)
+{
+  const char *path = args.export;
+  const char *slash = strrchr(path, '/');
+  const char *ext = strrchr(path, '.');
+  if((ext == NULL) || ((slash != NULL) && (ext < slash))) {
+    ext = path + strlen(path);
+  }
+
+  int n = snprintf(buf, size, "%.*s", (int)(ext - path), path);
+  if(global.ncodepoints > 1) {
+    n += snprintf(buf + n, size - n, "-");
+    format_codepoint(buf + n, size - n, character);
+    n += strlen(buf + n);
+  }
+  if(npages > 1) {
+    n += snprintf(buf + n, size - n, "-%d", page + 1);
+  }
+  snprintf(buf + n, size - n, "%s", ext);
+}
+
+/** Renders the grid for one code point into images, without X,
+ *  and writes one file per page.
+ *
+ * The layout is the one the window would use at the export size.
+ *
+ * \param fonts Fonts containing the character.
+ * \return Zero on success, negative on failure.
+ */
+int export_sheet(uint32_t character, const struct fontinfo *fonts, int nfonts)
+{
+  if((args.maxfonts > 0) && (args.maxfonts < nfonts))
+    nfonts = args.maxfonts;
+
+  int labelindex;
+  char *labelfile = match_font_file(FTNAMEFT, &labelindex);
+  if(labelfile == NULL) {
+    fprintf(stderr, "Could not find a font for labels.\n");
+    return -1;
+  }
+
+  FT_Library lib;
+  if(FT_Init_FreeType(&lib) != 0) {
+    free(labelfile);
+    return -1;
+  }
+
+  // Title bar, as in paint_window() without the buttons.
+  double titlepx = TITLEFONTSZ * EXPORTDPI / 72.0;
+  FT_Face title = open_face(lib, labelfile, labelindex, titlepx);
+  int titleheight = title ? (int)(title->size->metrics.height >> 6) : (int)titlepx;
+  int offset = 2 * VPADDING + titleheight + 2 * VPADDING;
+
+  struct image img = { args.exportwidth, args.exportheight, NULL };
+  struct grid_layout gl;
+  if((nfonts > 0) && (compute_layout(&gl, img.width, img.height - offset, nfonts, 1) < 0)) {
+    fprintf(stderr, "Export size %dx%d is too small.\n", img.width, img.height);
+    if(title)
+      FT_Done_Face(title);
+    FT_Done_FreeType(lib);
+    free(labelfile);
+    return -1;
+  }
+  int npages = nfonts > 0 ? gl.npages : 1;
+
+  // Scale family names to fit the widest, as gen_scale_title_font() does.
+  // Hinted widths don't scale exactly, so measure again at the new size.
+  double labelsize = INITFTSZ * EXPORTDPI / 72.0;
+  for(int pass = 0; (pass < 2) && (nfonts > 0); pass++) {
+    FT_Face label = open_face(lib, labelfile, labelindex, labelsize);
+    if(label == NULL)
+      break;
+    int maxwidth = 0;
+    for(int i = 0; i < nfonts; i++) {
+      int w = text_width(label, fonts[i].family);
+      if(w > maxwidth)
+        maxwidth = w;
+    }
+    double scale = (double)gl.frh / (double)(label->size->metrics.height >> 6);
+    if((maxwidth > 0) && ((double)gl.cw / maxwidth < scale))
+      scale = (double)gl.cw / maxwidth;
+    labelsize *= scale;
+    FT_Done_Face(label);
+  }
+
+  img.pixels = (unsigned char *)malloc(4 * (size_t)img.width * img.height);
+  if(img.pixels == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    if(title)
+      FT_Done_Face(title);
+    FT_Done_FreeType(lib);
+    free(labelfile);
+    return -1;
+  }
+
+  char hexchar[11];
+  format_codepoint(hexchar, sizeof(hexchar), character);
+  struct unicode_nameannot info = lookup_info(character);
+  char heading[256];
+  snprintf(heading, sizeof(heading), "%s %s", hexchar, info.name ? info.name : "");
+
+  int jobs = default_jobs();
+  pthread_t *threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+
+  int ret = 0;
+  for(int page = 0; (ret == 0) && (page < npages); page++) {
+    image_fill(&img, 0, 0, img.width, img.height, 255);
+    if(title != NULL) {
+      struct cliprect all = { 0, 0, img.width, img.height };
+      draw_text(&img, title, heading, 2 * HPADDING,
+                2 * VPADDING + titleheight + (int)(title->size->metrics.descender >> 6), &all);
+    }
+
+    struct export_job job;
+    memset(&job, 0, sizeof(job));
+    job.gl = &gl;
+    job.img = &img;
+    job.yoffset = offset;
+    job.character = character;
+    if(nfonts > 0) {
+      job.fonts = fonts + page * gl.perpage;
+      job.nfonts = nfonts - page * gl.perpage;
+      if(job.nfonts > gl.perpage)
+        job.nfonts = gl.perpage;
+    }
+    job.labelfile = labelfile;
+    job.labelindex = labelindex;
+    job.labelsize = labelsize;
+
+    for(int c = 0; c < job.nfonts; c++) {
+      image_rectangle(&img, (c % gl.nw) * gl.bw, (c / gl.nw) * gl.bh + offset, gl.bw, gl.bh);
+    }
+
+    int started = 0;
+    for(int t = 1; (threads != NULL) && (t < jobs) && (t < job.nfonts); t++) {
+      if(pthread_create(&threads[t], NULL, export_worker, &job) != 0)
+        break;
+      started = t;
+    }
+    export_worker(&job);
+    for(int t = 1; t <= started; t++) {
+      pthread_join(threads[t], NULL);
+    }
+
+    char path[4096];
+    export_filename(path, sizeof(path), character, page, npages);
+    DBG("Writing %s\n", path);
+    ret = write_image(path, &img);
+  }
+
+  free(threads);
+  free(img.pixels);
+  if(title)
+    FT_Done_Face(title);
+  FT_Done_FreeType(lib);
+  free(labelfile);
+
+  return ret;
+}
+
+/** Exports a sheet for every requested code point.
+ */
+int generate_export()
+{
+  if(reserve_results() < 0) {
+    return -1;
+  }
+
+  for(int r = 0; r < global.nranges; r++) {
+    for(uint32_t cp = global.ranges[r].first; cp <= global.ranges[r].last; cp++) {
+      int n = collect_fonts(cp);
+      if(export_sheet(cp, global.results, n) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Glyph measurements for --metrics, in units of 1/em of an em.
+struct glyph_metrics {
+  FT_UInt glyph;          // Glyph index, 0 if the cmap has none
+  long em;                // Units per em, or pixels per em for bitmap fonts
+  long advance;
+  long xmin, ymin, xmax, ymax;
+  long ascent, descent;   // Of the face, descent positive below the baseline
+  int empty;              // Nothing would be drawn
+  int notdef;             // Drawn as the face's .notdef glyph
+  int ok;                 // If the glyph could be loaded
+};
+
+// One code point and font to measure.
+struct metrics_item {
+  uint32_t cp;
+  struct fontinfo fi;
+  int next;               // Next item in the chunk for the same font
+  struct glyph_metrics m;
+};
+
+// Work shared by the threads measuring one chunk of items.
+struct metrics_job {
+  struct metrics_item *items;
+  int *heads;             // First item of each font in the chunk
+  int nheads;
+  int next;               // Next entry of heads to claim
+  int workers;            // Threads started, for trace ids
+};
+
+// Items measured between writing results out.
+#define METRICSCHUNK 4096
+
+/** Checks if an outline is the same as a saved one.
+ */
+int same_outline(const FT_Outline *a, const FT_Outline *b)
+{
+  return (a->n_points == b->n_points) && (a->n_contours == b->n_contours) &&
+         (memcmp(a->points, b->points, a->n_points * sizeof(*a->points)) == 0) &&
+         (memcmp(a->contours, b->contours, a->n_contours * sizeof(*a->contours)) == 0) &&
+         (memcmp(a->tags, b->tags, a->n_points) == 0);
+}
+
+/** Checks if a bitmap has any ink in it.
+ */
+int bitmap_inked(const FT_Bitmap *bm)
+{
+  int bytes = bm->pitch < 0 ? -bm->pitch : bm->pitch;
+  for(unsigned int y = 0; y < bm->rows; y++) {
+    const unsigned char *row = bm->buffer + (size_t)y * bytes;
+    for(int x = 0; x < bytes; x++) {
+      if(row[x])
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/** Measures every code point of one font's items.
+ *
+ * Scalable fonts are measured unscaled, in font units, so the
+ * figures don't depend on a size or hinting. Bitmap fonts use
+ * their first strike, in pixels.
+ */
+void measure_font(FT_Library lib, struct metrics_item *items, int first)
+{
+  const struct fontinfo *fi = &items[first].fi;
+  FT_Face face;
+  if(FT_New_Face(lib, fi->file, fi->index, &face) != 0) {
+    DBG("Could not open %s\n", fi->file);
+    return;
+  }
+
+  int scalable = FT_IS_SCALABLE(face);
+  FT_Int32 flags = FT_LOAD_NO_SCALE;
+  long em = face->units_per_EM, ascent = face->ascender, descent = -face->descender;
+  if(!scalable) {
+    if((face->num_fixed_sizes <= 0) || (FT_Select_Size(face, 0) != 0)) {
+      FT_Done_Face(face);
+      return;
+    }
+    flags = FT_LOAD_RENDER | FT_LOAD_COLOR;
+    em = face->available_sizes[0].y_ppem >> 6;
+    ascent = face->size->metrics.ascender >> 6;
+    descent = -face->size->metrics.descender >> 6;
+  }
+
+  // Keep .notdef's outline to spot glyphs that only repeat it.
+  FT_Outline notdef;
+  memset(&notdef, 0, sizeof(notdef));
+  if(scalable && (FT_Load_Glyph(face, 0, flags) == 0) &&
+     (face->glyph->format == FT_GLYPH_FORMAT_OUTLINE)) {
+    const FT_Outline *o = &face->glyph->outline;
+    notdef.points = (FT_Vector *)malloc(o->n_points * sizeof(*o->points) + 1);
+    // Tags are char or unsigned char, depending on the FreeType version.
+    notdef.tags = malloc(o->n_points + 1);
+    notdef.contours = (short *)malloc(o->n_contours * sizeof(*o->contours) + 1);
+    if((notdef.points != NULL) && (notdef.tags != NULL) && (notdef.contours != NULL)) {
+      notdef.n_points = o->n_points;
+      notdef.n_contours = o->n_contours;
+      memcpy(notdef.points, o->points, o->n_points * sizeof(*o->points));
+      memcpy(notdef.tags, o->tags, o->n_points);
+      memcpy(notdef.contours, o->contours, o->n_contours * sizeof(*o->contours));
+    }
+  }
+  int havenotdef = (notdef.points != NULL) && (notdef.tags != NULL) && (notdef.contours != NULL);
+
+  for(int i = first; i >= 0; i = items[i].next) {
+    struct glyph_metrics *m = &items[i].m;
+    m->glyph = FT_Get_Char_Index(face, items[i].cp);
+    if(FT_Load_Glyph(face, m->glyph, flags) != 0) {
+      continue;
+    }
+
+    FT_GlyphSlot g = face->glyph;
+    int shift = scalable ? 0 : 6;
+    m->em = em;
+    m->ascent = ascent;
+    m->descent = descent;
+    m->advance = g->metrics.horiAdvance >> shift;
+    m->xmin = g->metrics.horiBearingX >> shift;
+    m->xmax = (g->metrics.horiBearingX + g->metrics.width) >> shift;
+    m->ymax = g->metrics.horiBearingY >> shift;
+    m->ymin = (g->metrics.horiBearingY - g->metrics.height) >> shift;
+    if(g->format == FT_GLYPH_FORMAT_OUTLINE) {
+      m->empty = g->outline.n_points == 0;
+      m->notdef = (m->glyph == 0) ||
+                  (havenotdef && (notdef.n_points > 0) && same_outline(&g->outline, &notdef));
+    } else {
+      m->empty = !bitmap_inked(&g->bitmap);
+      m->notdef = m->glyph == 0;
+    }
+    m->ok = 1;
+  }
+
+  free(notdef.points);
+  free(notdef.tags);
+  free(notdef.contours);
+  FT_Done_Face(face);
+}
+
+/** Measures fonts of a chunk until none are left.
+ */
+void *metrics_worker(void *arg)
+{
+  struct metrics_job *job = (struct metrics_job *)arg;
+
+  FT_Library lib;
+  if(FT_Init_FreeType(&lib) != 0) {
+    return NULL;
+  }
+  trace_tid = __atomic_fetch_add(&job->workers, 1, __ATOMIC_RELAXED);
+
+  int h;
+  while((h = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nheads) {
+    double start = trace_begin();
+    int first = job->heads[h];
+    measure_font(lib, job->items, first);
+    trace_end("measure", job->items[first].fi.family, start);
+  }
+
+  FT_Done_FreeType(lib);
+
+  return NULL;
+}
+
+/** Writes the measurements of one code point in one font.
+ */
+void print_metrics(const struct metrics_item *it)
+{
+  const struct fontinfo *fi = &it->fi;
+  const struct glyph_metrics *m = &it->m;
+  char hexchar[11];
+  format_codepoint(hexchar, sizeof(hexchar), it->cp);
+
+  switch(args.format) {
+  case FORMAT_TEXT:
+  case FORMAT_JSONL:
+    fprintf(stdout, "{\"codepoint\":\"%s\",\"family\":", hexchar);
+    write_json_string(stdout, fi->family);
+    fputs(",\"style\":", stdout);
+    write_json_string(stdout, fi->style);
+    fputs(",\"file\":", stdout);
+    write_json_string(stdout, fi->file);
+    fprintf(stdout, ",\"index\":%d,\"glyph\":%u,\"em\":%ld,\"advance\":%ld,"
+            "\"xmin\":%ld,\"ymin\":%ld,\"xmax\":%ld,\"ymax\":%ld,"
+            "\"ascent\":%ld,\"descent\":%ld,\"empty\":%s,\"notdef\":%s}\n",
+            fi->index, m->glyph, m->em, m->advance, m->xmin, m->ymin, m->xmax, m->ymax,
+            m->ascent, m->descent, m->empty ? "true" : "false", m->notdef ? "true" : "false");
+    break;
+
+  case FORMAT_TSV:
+    fputs(hexchar, stdout);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->family);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->style);
+    putc('\t', stdout);
+    write_tsv_field(stdout, fi->file);
+    fprintf(stdout, "\t%d\t%u\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%d\t%d\n",
+            fi->index, m->glyph, m->em, m->advance, m->xmin, m->ymin, m->xmax, m->ymax,
+            m->ascent, m->descent, m->empty, m->notdef);
+    break;
+
+  case FORMAT_NUL:
+    printf("%s%c%s%c%s%c%s%c%d%c%u%c%ld%c%ld%c%ld%c%ld%c%ld%c%ld%c%ld%c%ld%c%d%c%d%c",
+           hexchar, 0, fi->family, 0, fi->style, 0, fi->file, 0, fi->index, 0, m->glyph, 0,
+           m->em, 0, m->advance, 0, m->xmin, 0, m->ymin, 0, m->xmax, 0, m->ymax, 0,
+           m->ascent, 0, m->descent, 0, m->empty, 0, m->notdef, 0);
+    break;
+  }
+}
+
+/** Measures a chunk of items on up to args.jobs threads,
+ *  then writes them out in order.
+ *
+ * \param lastof Scratch space, -1 for every candidate font.
+ */
+void run_metrics(struct metrics_item *items, int nitems, int *heads, int *lastof,
+                 pthread_t *threads, int jobs)
+{
+  struct metrics_job job;
+  memset(&job, 0, sizeof(job));
+  job.items = items;
+  job.heads = heads;
+
+  // Chain each font's items so its face is opened once.
+  for(int i = 0; i < nitems; i++) {
+    int id = items[i].fi.id;
+    items[i].next = -1;
+    if(lastof[id] < 0) {
+      heads[job.nheads++] = i;
+    } else {
+      items[lastof[id]].next = i;
+    }
+    lastof[id] = i;
+  }
+
+  int started = 0;
+  for(int t = 1; (threads != NULL) && (t < jobs) && (t < job.nheads); t++) {
+    if(pthread_create(&threads[t], NULL, metrics_worker, &job) != 0)
+      break;
+    started = t;
+  }
+  metrics_worker(&job);
+  for(int t = 1; t <= started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  for(int i = 0; i < nitems; i++) {
+    lastof[items[i].fi.id] = -1;
+    if(items[i].m.ok) {
+      print_metrics(&items[i]);
+    } else {
+      fprintf(stderr, "Could not load U+%04X from %s\n", items[i].cp, items[i].fi.file);
+    }
+  }
+}
+
+/** Prints glyph metrics of every requested code point in
+ *  each font found to contain it, read with FreeType.
+ *
+ * \return Zero on success, negative on failure.
+ */
+int generate_metrics()
+{
+  int max = reserve_results();
+  if(max < 0) {
+    return -1;
+  }
+
+  int jobs = default_jobs();
+
+  // A chunk can run over by one code point's fonts.
+  int cap = METRICSCHUNK + max;
+  struct metrics_item *items = (struct metrics_item *)calloc(cap, sizeof(*items));
+  int *heads = (int *)malloc(cap * sizeof(int));
+  int *lastof = (int *)malloc((max + 1) * sizeof(int));
+  pthread_t *threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+  if((items == NULL) || (heads == NULL) || (lastof == NULL)) {
+    fprintf(stderr, "Out of memory.\n");
+    free(items);
+    free(heads);
+    free(lastof);
+    free(threads);
+    return -1;
+  }
+  memset(lastof, 0xff, (max + 1) * sizeof(int));
+
+  int nitems = 0;
+  unsigned long measured = 0;
+  for(int r = 0; r < global.nranges; r++) {
+    for(uint32_t cp = global.ranges[r].first; cp <= global.ranges[r].last; cp++) {
+      int n = collect_fonts(cp);
+      if((args.maxfonts > 0) && (args.maxfonts < n))
+        n = args.maxfonts;
+      for(int i = 0; i < n; i++) {
+        memset(&items[nitems], 0, sizeof(items[nitems]));
+        items[nitems].cp = cp;
+        items[nitems].fi = global.results[i];
+        nitems++;
+      }
+      if(nitems >= METRICSCHUNK) {
+        run_metrics(items, nitems, heads, lastof, threads, jobs);
+        measured += nitems;
+        nitems = 0;
+      }
+    }
+  }
+  run_metrics(items, nitems, heads, lastof, threads, jobs);
+  measured += nitems;
+  stats_count("glyphs measured", measured);
+
+  free(items);
+  free(heads);
+  free(lastof);
+  free(threads);
+  return 0;
+}
+
+/** Determines the query server's socket path.
+ */
+void socket_path(char *path, size_t size)
+{
+  if(args.socket != NULL) {
+    snprintf(path, size, "%s", args.socket);
+    return;
+  }
+
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if((runtime != NULL) && (runtime[0] == '/')) {
+    snprintf(path, size, "%s/fc-char.sock", runtime);
+  } else {
+    snprintf(path, size, "/tmp/fc-char-%u.sock", (unsigned)getuid());
+  }
+}
+
+volatile sig_atomic_t stop_server = 0;
+
+void handle_stop(int sig)
+{
+  stop_server = 1;
+}
+
+/** Writes the response lines for one code point.
+ */
+void serve_codepoint(FILE *out, uint32_t cp)
+{
+  char hexchar[11];
+  format_codepoint(hexchar, sizeof(hexchar), cp);
+  struct unicode_nameannot info = lookup_info(cp);
+  if(info.name != NULL) {
+    fprintf(out, "%s %s\n", hexchar, info.name);
+  } else {
+    fprintf(out, "%s\n", hexchar);
+  }
+
+  int n = collect_fonts(cp);
+  for(int i = 0; i < n; i++) {
+    fprintf(out, "%s\t%s\t%s\n", global.results[i].family,
+            global.results[i].style, global.results[i].file);
+  }
+}
+
+/** Answers one request line from a client.
+ *
+ * A request is a hex code point, a U+XXXX..U+YYYY range or UTF-8
+ * characters. For each code point the response is its hex value and
+ * name, then one "family<TAB>style<TAB>file" line per font. Errors are
+ * reported as "ERR <message>". Every response ends with a "." line.
+ */
+void serve_request(FILE *out, char *line)
+{
+  uint32_t first, last;
+
+  if(has_hex_prefix(line)) {
+    char *end;
+    first = last = (uint32_t)strtol(line + 2, &end, 16);
+    if(strncmp(end, "..", 2) == 0) {
+      end += 2;
+      if(has_hex_prefix(end)) {
+        end += 2;
+      }
+      last = (uint32_t)strtol(end, &end, 16);
+    }
+    if((end == line + 2) || (*end != '\0') || (first > last) || (last > 0x10FFFF)) {
+      fprintf(out, "ERR Invalid code point '%s'.\n.\n", line);
+      return;
+    }
+    for(uint32_t cp = first; cp <= last; cp++) {
+      serve_codepoint(out, cp);
+    }
+    fprintf(out, ".\n");
+    return;
+  }
+
+  struct utf8_decoder dec;
+  memset(&dec, 0, sizeof(dec));
+  size_t len = strlen(line);
+  uint32_t *cps = (uint32_t *)malloc((len + 1) * sizeof(uint32_t));
+  if(cps == NULL) {
+    fprintf(out, "ERR Out of memory.\n.\n");
+    return;
+  }
+  size_t n = utf8_decode(&dec, (const unsigned char *)line, len, cps);
+  if((n == 0) || dec.invalid || dec.need) {
+    fprintf(out, "ERR Invalid UTF-8 request.\n");
+  }
+  for(size_t i = 0; (i < n) && !dec.invalid && !dec.need; i++) {
+    serve_codepoint(out, cps[i]);
+  }
+  fprintf(out, ".\n");
+  free(cps);
+}
+
+/** Writes a whole buffer to a socket.
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+  while(len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Longest request line accepted from a client.
+#define MAXREQUEST 4096
+// Most clients served at once.
+#define MAXCLIENTS 64
+
+struct client {
+  int fd;
+  size_t len;
+  char buf[MAXREQUEST];
+};
+
+/** Handles readable data from a client.
+ *
+ * \return Zero to keep the connection open, negative to close it.
+ */
+int serve_client(struct client *cl)
+{
+  ssize_t n = recv(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len, 0);
+  if(n < 0) {
+    return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+  }
+  if(n == 0) {
+    return -1;
+  }
+  cl->len += n;
+
+  char *resp = NULL;
+  size_t resplen = 0;
+  FILE *out = open_memstream(&resp, &resplen);
+  if(out == NULL) {
+    return -1;
+  }
+
+  char *start = cl->buf;
+  char *nl;
+  while((nl = memchr(start, '\n', cl->len - (start - cl->buf))) != NULL) {
+    *nl = '\0';
+    if((nl > start) && (nl[-1] == '\r')) {
+      nl[-1] = '\0';
+    }
+    if(*start != '\0') {
+      serve_request(out, start);
+    }
+    start = nl + 1;
+  }
+
+  cl->len -= start - cl->buf;
+  memmove(cl->buf, start, cl->len);
+  if(cl->len == sizeof(cl->buf)) {
+    fprintf(out, "ERR Request too long.\n.\n");
+    cl->len = 0;
+  }
+
+  fclose(out);
+  int ret = write_all(cl->fd, resp, resplen);
+  free(resp);
+
+  return ret;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+// How long font directories must be quiet before changes are applied.
+#define WATCHSETTLEMS 500
+
+// Font directories watched by --watch, and the files changed in them.
+struct font_watch {
+  int fd;
+  char **dirs;      // Path of each watch descriptor
+  int ndirs;
+  char **changed;   // Files changed since the last update
+  int nchanged;
+  int changedcap;
+  double due;       // When to apply the changes, zero if none
+};
+
+/** Notes a file as changed, to be looked at once changes settle.
+ */
+void watch_file(struct font_watch *w, const char *path)
+{
+  w->due = stats_clock() + WATCHSETTLEMS;
+  for(int i = 0; i < w->nchanged; i++) {
+    if(strcmp(w->changed[i], path) == 0)
+      return;
+  }
+
+  if(w->nchanged == w->changedcap) {
+    int newcap = w->changedcap ? 2 * w->changedcap : 64;
+    char **c = (char **)realloc(w->changed, newcap * sizeof(char *));
+    if(c == NULL)
+      return;
+    w->changed = c;
+    w->changedcap = newcap;
+  }
+  char *copy = strdup(path);
+  if(copy != NULL) {
+    w->changed[w->nchanged++] = copy;
+  }
+}
+
+/** Starts watching a directory for fonts being added or removed.
+ *
+ * \param scan Also note the files already in it, and watch its
+ *             subdirectories, for directories that just appeared.
+ */
+void watch_dir(struct font_watch *w, const char *dir, int scan)
+{
+  int wd = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                             IN_DELETE | IN_CREATE | IN_ONLYDIR);
+  if(wd < 0) {
+    DBG("Could not watch %s: %s\n", dir, strerror(errno));
+    return;
+  }
+  if(wd >= w->ndirs) {
+    char **d = (char **)realloc(w->dirs, (wd + 1) * sizeof(char *));
+    if(d == NULL)
+      return;
+    memset(d + w->ndirs, 0, (wd + 1 - w->ndirs) * sizeof(char *));
+    w->dirs = d;
+    w->ndirs = wd + 1;
+  }
+  if(w->dirs[wd] == NULL) {
+    w->dirs[wd] = strdup(dir);
+  }
+
+  DIR *dp = scan ? opendir(dir) : NULL;
+  if(dp == NULL) {
+    return;
+  }
+  struct dirent *de;
+  while((de = readdir(dp)) != NULL) {
+    if(de->d_name[0] == '.')
+      continue;
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if(stat(path, &st) < 0)
+      continue;
+    if(S_ISDIR(st.st_mode)) {
+      watch_dir(w, path, 1);
+    } else {
+      watch_file(w, path);
+    }
+  }
+  closedir(dp);
+}
+
+/** Watches every directory fontconfig takes fonts from.
+ *
+ * \return Zero on success, negative on error.
+ */
+int start_watch(struct font_watch *w)
+{
+  memset(w, 0, sizeof(*w));
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(w->fd < 0) {
+    fprintf(stderr, "Could not watch font directories: %s\n", strerror(errno));
+    return -1;
+  }
+
+  FcStrList *list = FcConfigGetFontDirs(NULL);
+  FcChar8 *dir;
+  while((list != NULL) && ((dir = FcStrListNext(list)) != NULL)) {
+    watch_dir(w, (const char *)dir, 0);
+  }
+  FcStrListDone(list);
+
+  return 0;
+}
+
+/** Reads pending notifications, noting the files they name.
+ */
+void read_watch(struct font_watch *w)
+{
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while((len = read(w->fd, buf, sizeof(buf))) > 0) {
+    for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if(ev->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Font change notifications were lost; restart the server to see them.\n");
+        continue;
+      }
+      if((ev->wd < 0) || (ev->wd >= w->ndirs) || (w->dirs[ev->wd] == NULL))
+        continue;
+      if(ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        continue;
+      }
+      if((ev->len == 0) || (ev->name[0] == '.'))
+        continue;
+
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", w->dirs[ev->wd], ev->name);
+      if(ev->mask & IN_ISDIR) {
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+          watch_dir(w, path, 1);
+      } else if(!(ev->mask & IN_CREATE)) {
+        // A created file is looked at once it's closed.
+        watch_file(w, path);
+      }
+    }
+  }
+}
+
+/** Checks if a file is one of those changed.
+ */
+int watch_has(const struct font_watch *w, const char *path)
+{
+  for(int i = 0; i < w->nchanged; i++) {
+    if(strcmp(w->changed[i], path) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/** Replaces the fonts of every changed file, in memory and in the
+ *  cached index, reading only those files.
+ *
+ * \return Zero on success, negative on error.
+ */
+int update_fonts(struct font_watch *w)
+{
+  double start = stats_clock();
+  FcFontSet *added = FcFontSetCreate();
+  FcFontSet *fs = FcFontSetCreate();
+  if((added == NULL) || (fs == NULL)) {
+    fprintf(stderr, "Out of memory.\n");
+    if(added != NULL)
+      FcFontSetDestroy(added);
+    if(fs != NULL)
+      FcFontSetDestroy(fs);
+    return -1;
   }
-  XTextProperty xtitle;
-  XStringListToTextProperty(&title, 1, &xtitle);
-  XSetWMName(global.dpy, global.win, &xtitle);
-  free(title);
-  // XFree(&xtext);
 
-  char smtitle[] = "fc-char";
-  char *psmtitle = &smtitle[0];
-  XTextProperty xsmtitle;
-  XStringListToTextProperty(&psmtitle, 1, &xsmtitle);
-  XSetWMIconName(global.dpy, global.win, &xsmtitle);
-  // XFree(&xsmtitle);
+  int gone = 0;
+  for(int i = 0; i < w->nchanged; i++) {
+    struct stat st;
+    if((stat(w->changed[i], &st) < 0) || !S_ISREG(st.st_mode)) {
+      gone++;
+      continue;
+    }
+    int count = 1;
+    for(int id = 0; id < count; id++) {
+      FcPattern *pat = FcFreeTypeQuery((const FcChar8 *)w->changed[i], id, NULL, &count);
+      if((pat != NULL) && !FcFontSetAdd(added, pat)) {
+        FcPatternDestroy(pat);
+      }
+    }
+  }
 
-  Atom delmsg = XInternAtom(global.dpy, "WM_DELETE_WINDOW", True);
-  stat = XSetWMProtocols(global.dpy, global.win, &delmsg, 1);
-  DBG("WMProtocol Status %d\n", stat);
+  int removed = 0;
+  for(int i = 0; i < global.allfs->nfont; i++) {
+    FcPattern *pat = global.allfs->fonts[i];
+    FcChar8 *file;
+    if((FcPatternGetString(pat, FC_FILE, 0, &file) == FcResultMatch) &&
+       watch_has(w, (const char *)file)) {
+      removed++;
+      continue;
+    }
+    FcPatternReference(pat);
+    FcFontSetAdd(fs, pat);
+  }
+  for(int i = 0; i < added->nfont; i++) {
+    FcBool scalable;
+    if(!args.fixed && ((FcPatternGetBool(added->fonts[i], FC_SCALABLE, 0, &scalable) != FcResultMatch) ||
+                       !scalable))
+      continue;
+    FcPatternReference(added->fonts[i]);
+    FcFontSetAdd(fs, added->fonts[i]);
+  }
 
+  DBG("%d files changed: %d fonts removed, %d added\n", w->nchanged, removed, added->nfont);
+  free_ranks();
+  free_fonts();
+  // --sort match and --fallback sort with fontconfig's own fonts. New
+  // files are added to it; only dropping or replacing fonts takes a
+  // full reload, as fontconfig cannot forget single files.
+  if(global.fcinit && ((args.sort == SORT_MATCH) || (args.fallback != NULL))) {
+    if((gone > 0) || (removed > 0)) {
+      if(!FcInitReinitialize())
+        DBG("Could not reload the fontconfig configuration.\n");
+    } else {
+      for(int i = 0; i < w->nchanged; i++) {
+        if(!FcConfigAppFontAddFile(NULL, (const FcChar8 *)w->changed[i]))
+          DBG("Fontconfig could not add %s\n", w->changed[i]);
+      }
+    }
+  }
+  int ret = use_fonts(fs);
 
-  DBG("Exposing window\n");
+  // Also keep the index current for queries that don't use the server.
+  if(patch_index(w->changed, w->nchanged, added) < 0) {
+    DBG("No index to update.\n");
+  }
+  FcFontSetDestroy(added);
 
-  // Expose the window
-  XMapWindow(global.dpy, global.win);
+  for(int i = 0; i < w->nchanged; i++) {
+    free(w->changed[i]);
+  }
+  w->nchanged = 0;
+  w->due = 0;
+  stats_phase("update_fonts", start);
 
-  return 0;
+  return ret;
 }
 
-/** Free X resources.
+/** Stops watching the font directories.
  */
-void close_x11()
+void stop_watch(struct font_watch *w)
 {
-  XftColorFree(global.dpy, XDefaultVisual(global.dpy, XDefaultScreen(global.dpy)),
-               XDefaultColormap(global.dpy, XDefaultScreen(global.dpy)), &global.ftblack);
-  XftDrawDestroy(global.xdraw);
-  XFreeGC(global.dpy, global.xgc);
-
-  if(global.backbuf != None) {
-    XdbeDeallocateBackBufferName(global.dpy, global.backbuf);
+  if(w->fd >= 0) {
+    close(w->fd);
   }
-
-  XUnmapWindow(global.dpy, global.win);
-  XDestroyWindow(global.dpy, global.win);
-  XCloseDisplay(global.dpy);
+  for(int i = 0; i < w->ndirs; i++) {
+    free(w->dirs[i]);
+  }
+  for(int i = 0; i < w->nchanged; i++) {
+    free(w->changed[i]);
+  }
+  free(w->dirs);
+  free(w->changed);
 }
+#endif
 
-/** Draws application window contents.
+/** Runs the query server until interrupted.
+ *
+ * Fonts and their charsets stay loaded, so each request costs
+ * only the in-memory charset tests. With --watch, fonts added to or
+ * removed from fontconfig's directories are picked up as they appear.
  */
-void paint_window()
+int run_server()
 {
-#define TITLEFONT "charter"
-#define TITLEFONTSZ 14.0
-  Window root;
-  int x, y;
-  unsigned int width, height, bwidth, depth;
-  XGetGeometry(global.dpy, global.draw, &root, &x, &y,
-               &width, &height, &bwidth, &depth);
-  DBG("Geometry (%d, %d) (%u, %u)\n", x, y, width, height);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  socket_path(addr.sun_path, sizeof(addr.sun_path));
 
-  XGCValues gcvalues;
-  gcvalues.foreground = global.white.pixel;
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(lfd < 0) {
+    fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+    return -1;
+  }
 
-  XChangeGC(global.dpy, global.xgc, GCForeground, &gcvalues);
-  XFillRectangle(global.dpy, global.draw, global.xgc, 0, 0, width, height);
+  if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    // Replace a socket left behind by a server that is gone.
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int alive = (errno == EADDRINUSE) && (probe >= 0) &&
+                (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    if(probe >= 0) {
+      close(probe);
+    }
+    if(alive || (unlink(addr.sun_path) < 0) ||
+       (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+      fprintf(stderr, "Could not bind %s: %s\n", addr.sun_path,
+              alive ? "server already running" : strerror(errno));
+      close(lfd);
+      return -1;
+    }
+  }
 
-  gcvalues.foreground = global.black.pixel;
-  XChangeGC(global.dpy, global.xgc, GCForeground, &gcvalues);
+  if(listen(lfd, 16) < 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", addr.sun_path, strerror(errno));
+    close(lfd);
+    unlink(addr.sun_path);
+    return -1;
+  }
 
-  // Add a quit button
-  XftFont *font = XftFontOpen(global.dpy, XDefaultScreen(global.dpy),
-                              FC_FAMILY, XftTypeString, TITLEFONT,
-                              FC_SIZE, XftTypeDouble, TITLEFONTSZ,
-                              NULL);
-  XGlyphInfo extents;
-  char quit[] = "Quit";
-  XftTextExtents8(global.dpy, font, &quit[0], strlen(quit), &extents);
-  global.quitdims[0] = HPADDING;
-  global.quitdims[1] = VPADDING;
-  int w = 2 * HPADDING + extents.width;
-  int h = 2 * VPADDING + font->height;
-  global.quitdims[2] = w;
-  global.quitdims[3] = h;
-  XDrawRectangle(global.dpy, global.draw, global.xgc, HPADDING, VPADDING, w, h);
-  XftDrawStringUtf8(global.xdraw, &global.ftblack, font,
-                    2 * HPADDING, 2 * VPADDING + font->height - font->descent,
-                    quit, strlen(quit));
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
-  DBG_P("Quit button\n");
+  DBG("Serving %d fonts on %s\n", global.allfs->nfont, addr.sun_path);
 
-  char *title;
-  if(global.info.name != NULL) {
-    int tsize = 16 + strlen(global.info.name);
-    title = (char *)malloc(tsize);
-    snprintf(title, tsize, "%s %s", global.hexchar, global.info.name);
-  } else {
-    title = (char *)malloc(16);
-    snprintf(title, 16, "%s", global.hexchar);
+#ifdef HAVE_SYS_INOTIFY_H
+  struct font_watch watch;
+  watch.fd = -1;
+  if(args.watch && (start_watch(&watch) < 0)) {
+    close(lfd);
+    unlink(addr.sun_path);
+    return -1;
   }
-  XftDrawStringUtf8(global.xdraw, &global.ftblack, font,
-                    2 * HPADDING + w, 2 * VPADDING + font->height - font->descent,
-                    title, strlen(title));
+#endif
 
-  DBG_P("Title\n");
+  struct client *clients[MAXCLIENTS];
+  struct pollfd pfds[MAXCLIENTS + 2];
+  int nclients = 0;
 
-  free(title);
-  XftFontClose(global.dpy, font);
+  while(!stop_server) {
+    int timeout = -1;
+    pfds[0].fd = lfd;
+    pfds[0].events = (nclients < MAXCLIENTS) ? POLLIN : 0;
+    pfds[1].fd = -1;
+    pfds[1].events = POLLIN;
+#ifdef HAVE_SYS_INOTIFY_H
+    pfds[1].fd = watch.fd;
+    if(watch.due > 0) {
+      double wait = watch.due - stats_clock();
+      timeout = wait > 0 ? (int)wait + 1 : 0;
+    }
+#endif
+    for(int i = 0; i < nclients; i++) {
+      pfds[i + 2].fd = clients[i]->fd;
+      pfds[i + 2].events = POLLIN;
+    }
 
-  // Draw character grid
-  int offset = h + 2 * VPADDING;
-  generate_grid(width, height - offset, offset, &global.character);
+    int nr = poll(pfds, nclients + 2, timeout);
+    if(nr < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      break;
+    }
 
-  if(global.backbuf != None) {
-    XdbeSwapInfo sinfo;
-    sinfo.swap_window = global.win;
-    sinfo.swap_action = XdbeCopied;
-    XdbeSwapBuffers(global.dpy, &sinfo, 1);
-  }
+#ifdef HAVE_SYS_INOTIFY_H
+    if(pfds[1].revents & POLLIN) {
+      read_watch(&watch);
+    }
+    // Font packages write many files; wait for them all.
+    if((watch.due > 0) && (stats_clock() >= watch.due) && (update_fonts(&watch) < 0)) {
+      break;
+    }
+#endif
 
-  XFlush(global.dpy);
-}
+    for(int i = nclients - 1; i >= 0; i--) {
+      if(pfds[i + 2].revents == 0)
+        continue;
+      if(serve_client(clients[i]) < 0) {
+        close(clients[i]->fd);
+        free(clients[i]);
+        clients[i] = clients[--nclients];
+      }
+    }
 
-void maybe_paint_window()
-{
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double now = (double)tv.tv_sec + ((double)tv.tv_usec / 1e6);
-    now *= 1e3; // Adjust to milliseconds
-    double diff = now - global.lastpaint;
-    DBG("maybe: diff %g dirty %d\n", diff, global.dirty);
+    if(pfds[0].revents & POLLIN) {
+      int cfd = accept(lfd, NULL, NULL);
+      if(cfd >= 0) {
+        struct client *cl = (struct client *)malloc(sizeof(*cl));
+        if(cl == NULL) {
+          close(cfd);
+        } else {
+          cl->fd = cfd;
+          cl->len = 0;
+          clients[nclients++] = cl;
+        }
+      }
+    }
+  }
 
-  if(((diff) > TIMEOUT) && (global.dirty)) {
-    paint_window();
-    global.dirty = 0;
-    global.lastpaint = now;
+  for(int i = 0; i < nclients; i++) {
+    close(clients[i]->fd);
+    free(clients[i]);
   }
-}
+#ifdef HAVE_SYS_INOTIFY_H
+  if(args.watch) {
+    stop_watch(&watch);
+  }
+#endif
+  close(lfd);
+  unlink(addr.sun_path);
 
+  return 0;
+}
 
-/** Checks if the given coordinates are within
- *  the bounds of the quit button.
+/** Sends one request to the server and prints its response.
+ *
+ * \return Zero on success, negative if the connection failed.
  */
-int check_quit_bounds(int x, int y)
+int client_request(int fd, FILE *in, const char *request)
 {
-    int dx = x - global.quitdims[0];
-    if((dx < 0) || (dx > global.quitdims[2]))
-      return 0;
+  size_t len = strlen(request);
+  if((write_all(fd, request, len) < 0) || (write_all(fd, "\n", 1) < 0)) {
+    return -1;
+  }
 
-    int dy = y - global.quitdims[1];
-    if((dy < 0) || (dy > global.quitdims[3]))
-      return 0;
+  char *line = NULL;
+  size_t linesz = 0;
+  int nfonts = 0;
+  int ret = 0;
+  while(1) {
+    if(getline(&line, &linesz, in) < 0) {
+      ret = -1;
+      break;
+    }
+    if(strcmp(line, ".\n") == 0) {
+      break;
+    }
+    if(strncmp(line, "ERR ", 4) == 0) {
+      fputs(line + 4, stderr);
+      continue;
+    }
+    if(strncmp(line, "U+", 2) == 0) {
+      nfonts = 0;
+    } else if((args.maxfonts > 0) && (nfonts++ >= args.maxfonts)) {
+      continue;
+    }
+    fputs(line, stdout);
+  }
+  free(line);
+  fflush(stdout);
 
-    return 1;
+  return ret;
 }
 
-/** Determines how a user has supplied a character
- *  and converts it to UTF32 and a hex string.
+/** Forwards requests from the command line, or stdin if none
+ *  are given, to a running server.
  */
-int parse_character(char *cchar)
+int run_client(int argc, char *argv[], int cindex)
 {
-  int hexstring = 0;
-  if(strstr(cchar, "0x") == cchar) {
-    hexstring = 1;
-  } else if(strstr(cchar, "0X") == cchar) {
-    hexstring = 1;
-  } else if(strstr(cchar, "U+") == cchar) {
-    hexstring = 1;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if((fd < 0) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+    fprintf(stderr, "Could not connect to %s: %s\n", addr.sun_path, strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  FILE *in = fdopen(dup(fd), "r");
+  if(in == NULL) {
+    close(fd);
+    return -1;
   }
 
-  if(hexstring) {
-    strncpy(global.hexchar, cchar, 11);
-    global.hexchar[0] = 'U';
-    global.hexchar[1] = '+';
-    global.character = (uint32_t)strtol(cchar + 2, NULL, 16);
+  int ret = 0;
+  if(cindex >= 0) {
+    for(int i = cindex; (ret == 0) && (i < argc); i++) {
+      ret = client_request(fd, in, argv[i]);
+    }
   } else {
-    if(convert_char(cchar, global.hexchar, 11, &global.character) == 0) {
-      fprintf(stderr, "Failed to convert character encoding.\n");
-      return -1;
+    char *line = NULL;
+    size_t linesz = 0;
+    ssize_t n;
+    while((ret == 0) && ((n = getline(&line, &linesz, stdin)) >= 0)) {
+      while((n > 0) && ((line[n - 1] == '\n') || (line[n - 1] == '\r')))
+        line[--n] = '\0';
+      if(n > 0)
+        ret = client_request(fd, in, line);
     }
+    free(line);
   }
 
-  return 0;
+  if(ret < 0) {
+    fprintf(stderr, "Lost connection to %s\n", addr.sun_path);
+  }
+  fclose(in);
+  close(fd);
+
+  return ret;
 }
 
-/** Searches for fonts containing the desired
- *  character and returns the font set found.
+
+#ifndef FC_CHAR_LITE
+/** Blocks until the X connection has input to read or
+ *  a cell worker has finished a box.
  */
-int generate_fontset()
+void wait_for_events(Display *disp, int timeout)
 {
-    global.info = UnicodeNameAnnot[(global.character>>16)&0x1f][(global.character>>8)&0xff][global.character&0xff];
-
-    FcPattern *pat = FcPatternCreate();
+    struct pollfd pfds[2];
+    pfds[0].fd = ConnectionNumber(disp);
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    pfds[1].fd = cells.wakefd[0];
+    pfds[1].events = POLLIN;
+    pfds[1].revents = 0;
+    int n = cells.wakefd[0] >= 0 ? 2 : 1;
+    while((poll(pfds, n, timeout) < 0) && (errno == EINTR))
+      ;
 
-    if(!args.fixed) {
-      FcPatternAddBool(pat, FC_SCALABLE, FcTrue);
+    if((n > 1) && (pfds[1].revents & POLLIN)) {
+      char buf[64];
+      while(read(cells.wakefd[0], buf, sizeof(buf)) > 0)
+        ;
     }
+}
 
-    FcCharSet *charset = FcCharSetCreate();
-    FcCharSetAddChar(charset, global.character);
-    FcPatternAddCharSet(pat, FC_CHARSET, charset);
-
-    FcObjectSet *os = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_FILE, (char *)0);
+#endif
 
-    global.fs = FcFontList(0, pat, os);
+/** Releases everything allocated to answer a query.
+ */
+void free_query()
+{
+    write_trace();
 
-    FcObjectSetDestroy(os);
-    FcPatternDestroy(pat);
-    FcCharSetDestroy(charset);
+    if(global.fs != NULL) {
+      FcFontSetDestroy(global.fs);
+    }
+    if(global.fallback != NULL) {
+      FcFontSetDestroy(global.fallback);
+    }
+    free(global.fallbackcs);
+    free_ranks();
+    free_fonts();
+    close_index();
+    free(global.results);
+    free(global.ranges);
+    free(global.matrix);
+    free(args.blocks);
+    free(global.groupslots);
+    free(global.groupnext);
+    free(global.grouptail);
+    free(global.styles.data);
+    if(global.iconv != (iconv_t)-1) {
+      iconv_close(global.iconv);
+    }
 
-    return 0;
+    if(global.fcinit) {
+      FcFini();
+    }
 }
 
 
-int XNextEventTimed(Display *disp, XEvent *event_return, int timeout)
+int main(int argc, char *argv[])
 {
-    if(XPending(disp) == 0) {
-      struct pollfd pfd;
-      pfd.fd = ConnectionNumber(disp);
-      pfd.events = POLLIN | POLLOUT | POLLPRI;
-      pfd.revents = 0;
-      int nr = poll(&pfd, 1, timeout);
-      if(nr > 0) {
-        if(XPending(disp) > 0) {
-          XNextEvent(disp, event_return);
-          return 1;
+    global.statstart = stats_clock();
+    global.utf8locale = -1;
+    global.iconv = (iconv_t)-1;
+    setlocale(LC_ALL, "");
+
+    int cindex = parse_arguments(argc, argv);
+    if(cindex == -2) {
+      return 1;
+    }
+
+#ifdef FC_CHAR_LITE
+    // Without a grid, list the fonts unless only names were asked for.
+    args.display = 0;
+    if(!args.showname && !args.showannot) {
+      args.printfonts = 1;
+    }
+#endif
+
+    // Records are written as they're found; flush in large blocks.
+    if(args.format != FORMAT_TEXT) {
+      setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    }
+
+    // The client only relays requests and needs no fonts.
+    if(args.client) {
+      return run_client(argc, argv, cindex) < 0 ? 1 : 0;
+    }
+
+    double start;
+    if(args.server) {
+      if(load_fonts() < 0) {
+        return 1;
+      }
+      // Watched changes are patched into the index, so start with one.
+      if(args.watch && !args.noindex) {
+        if((open_index() < 0) && (build_index() < 0)) {
+          fprintf(stderr, "Could not write font index.\n");
         }
+        close_index();
       }
-    } else {
-      XNextEvent(disp, event_return);
+      int ret = run_server();
+      free_query();
+      return ret < 0 ? 1 : 0;
+    }
+    if(args.text) {
+      if(args.reindex && (build_index() < 0)) {
+        fprintf(stderr, "Could not write font index.\n");
+      }
+      start = stats_clock();
+      if(load_fonts() < 0) {
+        return 1;
+      }
+      stats_phase("load_fonts", start);
+      start = stats_clock();
+      int ret = generate_text_coverage(args.textfile);
+      fflush(stdout);
+      stats_phase("text coverage", start);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    if(args.coverage) {
+      if(args.reindex && (build_index() < 0)) {
+        fprintf(stderr, "Could not write font index.\n");
+      }
+      start = stats_clock();
+      if(!args.noindex && (open_index() < 0) && (args.reindex || (build_index() < 0) ||
+                                                   (open_index() < 0))) {
+        DBG("Font index unavailable, listing fonts.\n");
+      }
+      if((global.index == NULL) && (load_fonts() < 0)) {
+        return 1;
+      }
+      stats_phase("load fonts", start);
+      start = stats_clock();
+      int ret = generate_coverage();
+      fflush(stdout);
+      stats_phase("coverage", start);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    if((cindex < 0) && (args.cpfile == NULL) && (args.nblocks == 0) && (args.search == NULL) &&
+       !args.gaps) {
+      fprintf(stderr, "Must supply a character value.\n");
       return 1;
     }
 
-    return 0;
-}
+    start = stats_clock();
+    for(int i = cindex; (i >= 0) && (i < argc); i++) {
+      if(parse_character(argv[i]) < 0) {
+        return 1;
+      }
+    }
 
+    if((args.cpfile != NULL) && (parse_character_file(args.cpfile) < 0)) {
+      return 1;
+    }
+    for(int i = 0; i < args.nblocks; i++) {
+      if(add_block(args.blocks[i]) < 0) {
+        return 1;
+      }
+    }
+    stats_phase("parse_character", start);
 
-int main(int argc, char *argv[])
-{
-    setlocale(LC_ALL, "");
-    FcInit();
+    if(args.search != NULL) {
+      start = stats_clock();
+      long found = search_names(args.search);
+      if(found < 0) {
+        return 1;
+      }
+      if(found == 0) {
+        fprintf(stderr, "No character names contain '%s'.\n", args.search);
+        return 1;
+      }
+      stats_phase("search_names", start);
+      stats_count("matching characters", found);
+    }
 
-    int cindex = parse_arguments(argc, argv);
-    if(cindex < 0) {
+    if(args.gaps) {
+      // Without a range, look for gaps anywhere in Unicode.
+      if((global.nranges == 0) && (add_range(0, 0x10FFFF) < 0)) {
+        return 1;
+      }
+      if(args.reindex && (build_index() < 0)) {
+        fprintf(stderr, "Could not write font index.\n");
+      }
+      start = stats_clock();
+      if(!args.noindex && (open_index() < 0) && (args.reindex || (build_index() < 0) ||
+                                                   (open_index() < 0))) {
+        DBG("Font index unavailable, listing fonts.\n");
+      }
+      if((global.index == NULL) && (load_fonts() < 0)) {
+        return 1;
+      }
+      stats_phase("load fonts", start);
+      start = stats_clock();
+      int ret = generate_gaps();
+      fflush(stdout);
+      stats_phase("gaps", start);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    if(global.ncodepoints == 0) {
       fprintf(stderr, "Must supply a character value.\n");
       return 1;
     }
 
-    parse_character(argv[cindex]);
-    generate_fontset();
+    if(args.reindex && (build_index() < 0)) {
+      fprintf(stderr, "Could not write font index.\n");
+    }
+
+    // Queries that are only printed are answered from the index.
+    if(!args.display && !args.noindex) {
+      start = stats_clock();
+      if(open_index() < 0) {
+        if(args.reindex || (build_index() < 0) || (open_index() < 0)) {
+          DBG("Font index unavailable, listing fonts.\n");
+        }
+      }
+      stats_phase("open_index", start);
+    }
+
+    start = stats_clock();
+    if((global.index == NULL) && (load_fonts() < 0)) {
+      return 1;
+    }
+    if(global.index == NULL) {
+      stats_phase("load_fonts", start);
+    }
+    stats_count("candidate fonts", global.index ? global.index->nfonts : (unsigned long)global.allfs->nfont);
+
+    if(args.fallback != NULL) {
+      start = stats_clock();
+      if(sort_fallback(args.fallback) < 0) {
+        return 1;
+      }
+      stats_phase("sort_fallback", start);
+    }
+
+    if(args.export != NULL) {
+      start = stats_clock();
+      int ret = generate_export();
+      stats_phase("generate_export", start);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    if(args.metrics) {
+      start = stats_clock();
+      int ret = generate_metrics();
+      fflush(stdout);
+      stats_phase("generate_metrics", start);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    // Many code points, or search results, are printed rather than
+    // displayed unless they're to be compared in a matrix.
+    int matrix = args.matrix && args.display && (global.ncodepoints > 1);
+    if(!matrix && ((global.ncodepoints > 1) || (args.search != NULL))) {
+      args.display = 0;
+      args.printfonts = 1;
+      start = stats_clock();
+      int ret = generate_batch();
+      fflush(stdout);
+      stats_phase("generate_batch", start);
+      stats_count("code points", global.ncodepoints);
+      free_query();
+      stats_phase("total", global.statstart);
+      return ret < 0 ? 1 : 0;
+    }
+
+    if(matrix && (prepare_matrix() < 0)) {
+      return 1;
+    }
+
+    start = stats_clock();
+    if(global.index != NULL) {
+      global.info = lookup_info(global.character);
+    } else if(generate_fontset() < 0) {
+      return 1;
+    } else {
+      stats_phase("generate_fontset", start);
+      stats_count("fonts found", global.fs->nfont);
+    }
 
+#ifndef FC_CHAR_LITE
     if(args.display) {
-      global.lastpaint = -1.0;
       global.dirty = 1;
 
-      initialize_x11();
+      start = stats_clock();
+      if((initialize_x11() < 0) || (start_cells() < 0)) {
+        stop_cells();
+        free_query();
+        return 1;
+      }
+      stats_phase("initialize_x11", start);
+
+      // Area of the window waiting to be repainted.
+      Region damage = XCreateRegion();
 
       int quitclicked = 0;
       int quit = 0;
       while(!quit) {
+        // Merge every queued event before repainting once, then
+        // fill in a few characters at a time while the queue is empty.
+        if(XPending(global.dpy) == 0) {
+          // While a resize settles, keep showing the old render.
+          if(global.resizedue > 0) {
+            double wait = global.resizedue - stats_clock();
+            if(wait > 0) {
+              if(!XEmptyRegion(damage) && global.bufvalid) {
+                XRectangle box;
+                XClipBox(damage, &box);
+                show_buffer(box.x, box.y, box.width, box.height);
+              }
+              XDestroyRegion(damage);
+              damage = XCreateRegion();
+              wait_for_events(global.dpy, (int)wait + 1);
+              continue;
+            }
+            global.resizedue = 0;
+            global.dirty = 1;
+            XRectangle rect = { 0, 0, global.winwidth, global.winheight };
+            XUnionRectWithRegion(&rect, damage, damage);
+          }
+
+          if(!XEmptyRegion(damage)) {
+            repaint_damage(damage);
+            XDestroyRegion(damage);
+            damage = XCreateRegion();
+          } else if(cells_waiting()) {
+            FcChar32 *chars = matrix ? global.matrix : &global.character;
+            if((draw_cells(&global.layout, CELLBATCH, chars) == 0) &&
+               !global.painted) {
+              global.painted = 1;
+              stats_phase("first paint", global.statstart);
+              stats_count("X requests", XNextRequest(global.dpy) - 1);
+            }
+          } else {
+            wait_for_events(global.dpy, -1);
+          }
+          continue;
+        }
+
         XEvent event;
-        int nr = XNextEventTimed(global.dpy, &event, TIMEOUT);
-        if(nr == 0) {
-          DBG("timeout\n");
-          maybe_paint_window();
-        } else if(nr > 0) {
-          switch(event.type) {
-        case Expose:
+        int pagechange = 0;
+        XNextEvent(global.dpy, &event);
+        switch(event.type) {
+        case Expose: {
           DBG("expose\n");
-          global.dirty = 1;
-          maybe_paint_window();
+          XRectangle rect = { event.xexpose.x, event.xexpose.y,
+                              event.xexpose.width, event.xexpose.height };
+          XUnionRectWithRegion(&rect, damage, damage);
+          break;
+        }
+
+        case ConfigureNotify:
+          // Sizes seen during a drag only push back the repaint.
+          DBG("configure %d x %d\n", event.xconfigure.width, event.xconfigure.height);
+          global.winwidth = event.xconfigure.width;
+          global.winheight = event.xconfigure.height;
+          if((global.winwidth == global.bufwidth) && (global.winheight == global.bufheight)) {
+            global.resizedue = 0;
+          } else if(global.bufvalid) {
+            global.resizedue = stats_clock() + SETTLEMS;
+          } else {
+            // Nothing to show yet, lay out at once.
+            XRectangle rect = { 0, 0, global.winwidth, global.winheight };
+            XUnionRectWithRegion(&rect, damage, damage);
+            global.dirty = 1;
+          }
+          break;
+
+        case MapNotify:
+        case UnmapNotify:
+        case ReparentNotify:
+        case GravityNotify:
+        case CirculateNotify:
           break;
 
         case ButtonPress:
-          if(check_quit_bounds(event.xbutton.x, event.xbutton.y)) {
+          if(event.xbutton.button == Button4) {
+            pagechange = goto_page(global.page - 1);
+          } else if(event.xbutton.button == Button5) {
+            pagechange = goto_page(global.page + 1);
+          } else if((event.xbutton.button == Button1) &&
+                    check_bounds(global.quitdims, event.xbutton.x, event.xbutton.y)) {
             quitclicked = 1;
           }
           break;
 
         case ButtonRelease:
-          if(check_quit_bounds(event.xbutton.x, event.xbutton.y)) {
+          if(event.xbutton.button != Button1) {
+            break;
+          }
+          if(check_bounds(global.quitdims, event.xbutton.x, event.xbutton.y)) {
             quit = 1;
           } else {
             quitclicked = 0;
+            if(check_bounds(global.prevdims, event.xbutton.x, event.xbutton.y)) {
+              pagechange = goto_page(global.page - 1);
+            } else if(check_bounds(global.nextdims, event.xbutton.x, event.xbutton.y)) {
+              pagechange = goto_page(global.page + 1);
+            }
+          }
+          break;
+
+        case KeyPress:
+          switch(XLookupKeysym(&event.xkey, 0)) {
+          case XK_Next:
+          case XK_Right:
+          case XK_Down:
+          case XK_space:
+            pagechange = goto_page(global.page + 1);
+            break;
+          case XK_Prior:
+          case XK_Left:
+          case XK_Up:
+          case XK_BackSpace:
+            pagechange = goto_page(global.page - 1);
+            break;
+          case XK_Home:
+            pagechange = goto_page(0);
+            break;
+          case XK_End:
+            pagechange = goto_page(global.layout.npages - 1);
+            break;
+          case XK_q:
+          case XK_Escape:
+            quit = 1;
+            break;
+          }
+          break;
+
+        case KeyRelease:
+          break;
+
+        case ClientMessage:
+          if((event.xclient.format == 32) &&
+             ((Atom)event.xclient.data.l[0] == global.wmdelete)) {
+            quit = 1;
           }
           break;
 
@@ -720,14 +7287,22 @@ int main(int argc, char *argv[])
           fprintf(stderr, "Unhandled X11 message %d. Exiting.\n", event.type);
           quit = 1;
           break;
-          }
+        }
+
+        if(pagechange) {
+          XRectangle rect = { 0, 0, global.bufwidth, global.bufheight };
+          XUnionRectWithRegion(&rect, damage, damage);
         }
       }
 
+      XDestroyRegion(damage);
+      stats_count("X requests", XNextRequest(global.dpy) - 1);
+      stop_cells();
       close_x11();
     }
+#endif
 
-    if(args.showname) {
+    if(args.showname && (args.format == FORMAT_TEXT)) {
       if(global.info.name != NULL) {
         printf("Name: %s\n", global.info.name);
       } else {
@@ -735,7 +7310,7 @@ int main(int argc, char *argv[])
       }
     }
 
-    if(args.showannot) {
+    if(args.showannot && (args.format == FORMAT_TEXT)) {
       if(global.info.annot != NULL) {
         printf("%s\n", global.info.annot);
       } else {
@@ -743,27 +7318,19 @@ int main(int argc, char *argv[])
       }
     }
 
-    int end = global.fs->nfont;
-    if((args.maxfonts > 0) && (args.maxfonts < end))
-      end = args.maxfonts;
-
     // Print font families
     if(args.printfonts) {
-      for(int j = 0; j < end; j++)
-      {
-          FcChar8 *family = FcPatternFormat(global.fs->fonts[j], (FcChar8 *)"%{family[0]}");
-          if(family == NULL) {
-            fprintf(stderr, "Error formatting font family.\n");
-            return 1;
-          }
-          printf("%s\n", family);
-          free(family);
-      }
+      start = stats_clock();
+      print_fonts(global.character, "");
+      fflush(stdout);
+      stats_phase("print_fonts", start);
+    }
+    if(global.fallback) {
+      print_fallback(global.character, "");
     }
 
-    FcFontSetDestroy(global.fs);
-
-    FcFini();
+    free_query();
+    stats_phase("total", global.statstart);
 
     return 0;
 }